@@ -27,6 +27,7 @@
 #include <stdarg.h>
 
 #include "bsp_gpio.h"
+#include "bsp_spi.h"
 
 #define HYDRAFW_VERSION "HydraFW (HydraBus) " HYDRAFW_GIT_TAG " " HYDRAFW_CHECKIN_DATE
 #define TEST_WA_SIZE    THD_WORKING_AREA_SIZE(256)
@@ -528,6 +529,56 @@ int cmd_debug_test_rx(t_hydra_console *con, t_tokenline_parsed *p)
 	return TRUE;
 }
 
+#define SPI_BENCH_LOOP (1000)
+/*
+ * Average CPU cycles per transfer on SPI1 at 42MHz for each transfer method,
+ * the wire time is 32 cycles per byte.
+ */
+int cmd_debug_spi_bench(t_hydra_console *con, t_tokenline_parsed *p)
+{
+	static const uint32_t lengths[] = { 1, 2, 4, 16, 64, 256 };
+	static const bsp_spi_xfer_t xfers[] = {
+		BSP_SPI_XFER_HAL, BSP_SPI_XFER_DMA,
+		BSP_SPI_XFER_FAST, BSP_SPI_XFER_AUTO
+	};
+	mode_config_proto_t proto;
+	uint8_t *tx_data = (uint8_t *)g_sbuf;
+	uint8_t *rx_data = (uint8_t *)g_sbuf + 256;
+	uint32_t i, j, n, start, cycles;
+
+	(void)p;
+
+	memset(&proto, 0, sizeof(proto));
+	proto.dev_num = BSP_DEV_SPI1;
+	proto.dev_gpio_pull = MODE_CONFIG_DEV_GPIO_NOPULL;
+	proto.dev_mode = DEV_SPI_MASTER;
+	proto.dev_speed = 7;
+	proto.dev_bit_lsb_msb = DEV_SPI_FIRSTBIT_MSB;
+	if (bsp_spi_init(BSP_DEV_SPI1, &proto) != BSP_OK) {
+		cprintf(con, "bsp_spi_init() error\r\n");
+		return FALSE;
+	}
+	memset(tx_data, 0x55, 256);
+
+	cprintf(con, "Bytes\tWire\tHAL\tDMA\tFast\tAuto (cycles)\r\n");
+	for (i = 0; i < ARRAY_SIZE(lengths); i++) {
+		cprintf(con, "%d\t%d", lengths[i], lengths[i] * 32);
+		for (j = 0; j < ARRAY_SIZE(xfers); j++) {
+			bsp_spi_set_xfer(BSP_DEV_SPI1, xfers[j]);
+			start = get_cyclecounter();
+			for (n = 0; n < SPI_BENCH_LOOP; n++)
+				bsp_spi_write_read_u8(BSP_DEV_SPI1, tx_data,
+						      rx_data, lengths[i]);
+			cycles = get_cyclecounter() - start;
+			cprintf(con, "\t%d", cycles / SPI_BENCH_LOOP);
+		}
+		cprintf(con, "\r\n");
+	}
+	bsp_spi_deinit(BSP_DEV_SPI1);
+
+	return TRUE;
+}
+
 /*
  If used this function shall be called at least every 2^32 cycles (to avoid overflow)
  (2^32 cycles => 25.56 seconds @168MHz)
@@ -112,6 +112,10 @@ typedef struct {
 #define MIN(a, b) (a < b ? a : b)
 #endif
 
+#ifndef MAX
+#define MAX(a, b) (a > b ? a : b)
+#endif
+
 #ifndef BIT
 #define BIT(x) (1 << x)
 #endif
@@ -156,6 +160,7 @@ int mode_exit(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_show(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_debug_timing(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_debug_test_rx(t_hydra_console *con, t_tokenline_parsed *p);
+int cmd_debug_spi_bench(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_sd(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_show_sd(t_hydra_console *con);
 bool log_open(t_hydra_console *con);
@@ -167,6 +172,7 @@ int cmd_pwm(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_freq(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_gpio(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_sump(t_hydra_console *con, t_tokenline_parsed *p);
+int cmd_pattern(t_hydra_console *con, t_tokenline_parsed *p);
 int cmd_rng(t_hydra_console *con, t_tokenline_parsed *p);
 
 void token_dump(t_hydra_console *con, t_tokenline_parsed *p);
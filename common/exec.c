@@ -120,6 +120,9 @@ static int cmd_debug(t_hydra_console *con, t_tokenline_parsed *p)
 		case T_DEBUG_TEST_RX:
 			cmd_debug_test_rx(con, p);
 			break;
+		case T_DEBUG_SPI_BENCH:
+			cmd_debug_spi_bench(con, p);
+			break;
 		case T_ON:
 		case T_OFF:
 			action = p->tokens[t];
@@ -241,6 +244,7 @@ static struct cmd_map {
 	{ T_FREQUENCY, cmd_freq },
 	{ T_GPIO, cmd_gpio },
 	{ T_SUMP, cmd_sump },
+	{ T_PATTERN, cmd_pattern },
 	{ T_JTAG, cmd_mode_init },
 	{ T_RNG, cmd_rng },
 	{ T_TWOWIRE, cmd_mode_init },
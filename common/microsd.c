@@ -60,6 +60,14 @@ bool is_fs_ready(void)
 	return fs_ready;
 }
 
+/* Give PC8-PC12 back to the SDIO after they were used as GPIO */
+void sd_gpio_init(void)
+{
+	palSetGroupMode(GPIOC, 0x1f, GPIOC_SDIO_D0,
+			PAL_MODE_ALTERNATE(12) | PAL_STM32_OSPEED_MID2 |
+			PAL_STM32_PUPDR_PULLUP);
+}
+
 bool is_file_present(char * filename)
 {
 	FRESULT err;
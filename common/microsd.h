@@ -31,6 +31,7 @@ typedef struct {
 } filename_t;
 
 bool is_fs_ready(void);
+void sd_gpio_init(void);
 bool is_file_present(char * filename);
 
 int write_file(uint8_t* buffer, uint32_t size);
@@ -0,0 +1,64 @@
+/*
+HydraBus/HydraNFC - Copyright (C) 2014-2016 Benjamin VERNOUX
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#include "bsp_crc.h"
+#include "stm32f405xx.h"
+#include <string.h>
+
+/** \brief Init CRC unit and reset the CRC to 0xFFFFFFFF.
+ *
+ * \return bsp_status_t: status of the init.
+ *
+ */
+bsp_status_t bsp_crc_init(void)
+{
+	__CRC_CLK_ENABLE();
+
+	CRC->CR = CRC_CR_RESET;
+
+	return BSP_OK;
+}
+
+/** \brief De-initialize the CRC unit.
+ *
+ * \return bsp_status_t: Status of the deinit.
+ *
+ */
+bsp_status_t bsp_crc_deinit(void)
+{
+	__CRC_CLK_DISABLE();
+
+	return BSP_OK;
+}
+
+/** \brief Feed 32-bit little endian words to the CRC unit.
+ * The unit works MSB first on words, input and result are bit reversed
+ * so the CRC is the usual reflected CRC-32 (zlib) register.
+ *
+ * \param data const uint8_t*: data, no alignment required.
+ * \param nb_words uint32_t: number of 32-bit words.
+ * \return uint32_t: CRC register, without the final XOR.
+ *
+ */
+uint32_t bsp_crc_update(const uint8_t *data, uint32_t nb_words)
+{
+	uint32_t i, word;
+
+	for(i = 0; i < nb_words; i++) {
+		memcpy(&word, data + i * 4, sizeof(word));
+		CRC->DR = __RBIT(word);
+	}
+
+	return __RBIT(CRC->DR);
+}
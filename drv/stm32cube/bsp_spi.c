@@ -12,6 +12,8 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include "ch.h"
+#include "hal.h"
 #include "bsp_spi.h"
 #include "bsp_spi_conf.h"
 #include "stm32f405xx.h"
@@ -25,6 +27,40 @@ Warning in order to use this driver all GPIOs peripherals shall be enabled.
 static SPI_HandleTypeDef spi_handle[NB_SPI];
 static mode_config_proto_t* spi_mode_conf[NB_SPI];
 
+#define SPI_DMA_IRQ_PRIORITY (6)
+#define SPI_DMA_MAX_LEN (0xFFFF) /* NDTR is 16bits */
+#define SPI_DMA_LOOP_MAX_LEN (0x10000) /* Two halves in double buffer mode */
+#define SPI_DMA_POLL_TICKS (100) /* UBTN is checked every 10ms */
+
+typedef struct {
+	const stm32_dma_stream_t* rx;
+	const stm32_dma_stream_t* tx;
+	uint32_t mode;
+	bool allocated;
+	bool use_tx;
+	/* A transfer started by bsp_spi_read_u8_start() is running */
+	bool busy;
+	semaphore_t sem;
+	volatile bsp_status_t status;
+	/* Circular RX, bytes received = laps * circ_len + circ_pos */
+	bool circular;
+	uint32_t circ_len;
+	uint32_t circ_laps;
+	uint32_t circ_pos;
+	/* Slave TX loop, started by the TX stream interrupt when not NULL */
+	const uint8_t* tx_loop;
+	uint32_t tx_loop_len;
+} spi_dma_t;
+
+static spi_dma_t spi_dma[NB_SPI];
+static bsp_spi_xfer_t spi_xfer_mode[NB_SPI];
+
+/* Transfers up to this length are done by polling the registers */
+#define SPI_FAST_MAX_LEN (4)
+/* Sent while reading, and sink for the data received while writing */
+static const uint8_t spi_dma_tx_dummy = 0xFF;
+static uint8_t spi_dma_rx_dummy;
+
 /**
   * @brief  Init low level hardware: GPIO, CLOCK, NVIC...
   * @param  dev_num: SPI dev num
@@ -34,7 +70,8 @@ static mode_config_proto_t* spi_mode_conf[NB_SPI];
   This function replaces HAL_SPI_MspInit() in order to manage multiple devices.
   HAL_SPI_MspInit() shall be empty/not defined
 */
-static void spi_gpio_hw_init(bsp_dev_spi_t dev_num, uint32_t gpio_sck_miso_mosi_pull)
+static void spi_gpio_hw_init(bsp_dev_spi_t dev_num, uint32_t gpio_sck_miso_mosi_pull,
+			     uint32_t gpio_nss_mode)
 {
 	GPIO_InitTypeDef   GPIO_InitStructure;
 
@@ -43,7 +80,7 @@ static void spi_gpio_hw_init(bsp_dev_spi_t dev_num, uint32_t gpio_sck_miso_mosi_
 		__SPI1_CLK_ENABLE();
 
 		/* SPI NSS pin configuration */
-		GPIO_InitStructure.Mode = GPIO_MODE_OUTPUT_PP;
+		GPIO_InitStructure.Mode = gpio_nss_mode;
 		GPIO_InitStructure.Pull  = GPIO_PULLUP;
 		GPIO_InitStructure.Speed = GPIO_SPEED_HIGH;
 		GPIO_InitStructure.Pin = BSP_SPI1_NSS_PIN;
@@ -70,7 +107,7 @@ static void spi_gpio_hw_init(bsp_dev_spi_t dev_num, uint32_t gpio_sck_miso_mosi_
 		__SPI2_CLK_ENABLE();
 
 		/* SPI NSS pin configuration */
-		GPIO_InitStructure.Mode = GPIO_MODE_OUTPUT_PP;
+		GPIO_InitStructure.Mode = gpio_nss_mode;
 		GPIO_InitStructure.Pull  = GPIO_PULLUP;
 		GPIO_InitStructure.Speed = GPIO_SPEED_FAST;
 		GPIO_InitStructure.Pin = BSP_SPI2_NSS_PIN;
@@ -79,7 +116,7 @@ static void spi_gpio_hw_init(bsp_dev_spi_t dev_num, uint32_t gpio_sck_miso_mosi_
 		/* SPI SCK pin configuration */
 		GPIO_InitStructure.Mode = GPIO_MODE_AF_PP;
 		GPIO_InitStructure.Pull  = gpio_sck_miso_mosi_pull;
-		GPIO_InitStructure.Speed = GPIO_SPEED_FAST;
+		GPIO_InitStructure.Speed = BSP_SPI2_GPIO_SPEED;
 		GPIO_InitStructure.Alternate = BSP_SPI2_AF;
 		GPIO_InitStructure.Pin = BSP_SPI2_SCK_PIN;
 		HAL_GPIO_Init(BSP_SPI2_SCK_PORT, &GPIO_InitStructure);
@@ -131,6 +168,347 @@ static void spi_gpio_hw_deinit(bsp_dev_spi_t dev_num)
 	}
 }
 
+/* Interrupts disabled, called at least twice per lap to see the wraps */
+static uint32_t spi_dma_circular_count(spi_dma_t* dma)
+{
+	uint32_t pos;
+
+	pos = dma->circ_len - dmaStreamGetTransactionSize(dma->rx);
+	if(pos < dma->circ_pos)
+		dma->circ_laps++;
+	dma->circ_pos = pos;
+
+	return (dma->circ_laps * dma->circ_len) + pos;
+}
+
+/* The transfer is over once the last byte has been received */
+static void spi_dma_rx_isr(void *p, uint32_t flags)
+{
+	spi_dma_t* dma = p;
+
+	if(dma->circular) {
+		if(flags & (STM32_DMA_ISR_HTIF | STM32_DMA_ISR_TCIF)) {
+			chSysLockFromISR();
+			spi_dma_circular_count(dma);
+			chSysUnlockFromISR();
+		}
+		return;
+	}
+
+	if(flags & STM32_DMA_ISR_TEIF) {
+		dma->status = BSP_ERROR;
+	} else if((flags & STM32_DMA_ISR_TCIF) == 0) {
+		return;
+	}
+
+	chSysLockFromISR();
+	chSemSignalI(&dma->sem);
+	chSysUnlockFromISR();
+}
+
+/* Endless transfer of the whole loop buffer, without interrupt */
+static void spi_dma_tx_loop(spi_dma_t* dma)
+{
+	uint32_t mode, len;
+
+	mode = dma->mode | STM32_DMA_CR_DIR_M2P | STM32_DMA_CR_PL(3) |
+	       STM32_DMA_CR_MINC;
+	len = dma->tx_loop_len;
+	dmaStreamSetMemory0(dma->tx, dma->tx_loop);
+	if(len > SPI_DMA_MAX_LEN) {
+		len /= 2;
+		dmaStreamSetMemory1(dma->tx, dma->tx_loop + len);
+		mode |= STM32_DMA_CR_DBM;
+	} else {
+		mode |= STM32_DMA_CR_CIRC;
+	}
+	dmaStreamSetTransactionSize(dma->tx, len);
+	dmaStreamSetMode(dma->tx, mode);
+	dma->tx_loop = NULL;
+	dmaStreamEnable(dma->tx);
+}
+
+static void spi_dma_tx_isr(void *p, uint32_t flags)
+{
+	spi_dma_t* dma = p;
+
+	if((flags & STM32_DMA_ISR_TCIF) && (dma->tx_loop != NULL)) {
+		spi_dma_tx_loop(dma);
+		return;
+	}
+	if((flags & STM32_DMA_ISR_TEIF) == 0) {
+		return;
+	}
+	dma->status = BSP_ERROR;
+
+	chSysLockFromISR();
+	chSemSignalI(&dma->sem);
+	chSysUnlockFromISR();
+}
+
+/**
+  * @brief  Allocate the DMA streams of a SPI device.
+  * @param  dev_num: SPI dev num
+  * @retval None
+  */
+/*
+  The streams can already be owned by the ChibiOS SPI driver (HydraNFC sniffer),
+  in this case transfers fall back to the HAL polling functions.
+*/
+static void spi_dma_init(bsp_dev_spi_t dev_num)
+{
+	spi_dma_t* dma;
+
+	dma = &spi_dma[dev_num];
+	if(dma->allocated)
+		return;
+
+	if(dev_num == BSP_DEV_SPI1) {
+		dma->rx = STM32_DMA_STREAM(BSP_SPI1_DMA_RX_STREAM);
+		dma->tx = STM32_DMA_STREAM(BSP_SPI1_DMA_TX_STREAM);
+		dma->mode = STM32_DMA_CR_CHSEL(BSP_SPI1_DMA_CHANNEL);
+	} else { /* SPI2 */
+		dma->rx = STM32_DMA_STREAM(BSP_SPI2_DMA_RX_STREAM);
+		dma->tx = STM32_DMA_STREAM(BSP_SPI2_DMA_TX_STREAM);
+		dma->mode = STM32_DMA_CR_CHSEL(BSP_SPI2_DMA_CHANNEL);
+	}
+	/* Byte transfers, error interrupts */
+	dma->mode |= STM32_DMA_CR_PSIZE_BYTE | STM32_DMA_CR_MSIZE_BYTE |
+		     STM32_DMA_CR_TEIE;
+
+	if(dmaStreamAllocate(dma->rx, SPI_DMA_IRQ_PRIORITY,
+			     spi_dma_rx_isr, dma)) {
+		return;
+	}
+	if(dmaStreamAllocate(dma->tx, SPI_DMA_IRQ_PRIORITY,
+			     spi_dma_tx_isr, dma)) {
+		dmaStreamRelease(dma->rx);
+		return;
+	}
+	chSemObjectInit(&dma->sem, 0);
+	dma->allocated = TRUE;
+}
+
+static void spi_dma_deinit(bsp_dev_spi_t dev_num)
+{
+	spi_dma_t* dma;
+
+	dma = &spi_dma[dev_num];
+	if(!dma->allocated)
+		return;
+
+	if(dma->circular) {
+		dmaStreamDisable(dma->rx);
+		dma->circular = FALSE;
+	}
+	dmaStreamRelease(dma->rx);
+	dmaStreamRelease(dma->tx);
+	dma->allocated = FALSE;
+}
+
+static bsp_status_t spi_dma_wait(spi_dma_t* dma)
+{
+	uint32_t ticks;
+
+	ticks = 0;
+	while(chSemWaitTimeout(&dma->sem, SPI_DMA_POLL_TICKS) != MSG_OK) {
+		ticks += SPI_DMA_POLL_TICKS;
+		if(USER_BUTTON || (ticks >= SPIx_TIMEOUT_MAX))
+			return BSP_TIMEOUT;
+	}
+	return dma->status;
+}
+
+/*
+  Start a DMA transfer of up to SPI_DMA_MAX_LEN bytes.
+  TX is fed by DMA so there is no gap between bytes even at 42MHz.
+  In slave mode a read does not touch the TX buffer, as with HAL_SPI_Receive().
+*/
+static void spi_dma_start(bsp_dev_spi_t dev_num, const uint8_t* tx_data,
+			  uint8_t* rx_data, uint32_t len)
+{
+	SPI_TypeDef* spi;
+	spi_dma_t* dma;
+	uint32_t mode;
+
+	spi = spi_handle[dev_num].Instance;
+	dma = &spi_dma[dev_num];
+	dma->use_tx = (tx_data != NULL) ||
+		      (spi_handle[dev_num].Init.Mode == SPI_MODE_MASTER);
+
+	mode = dma->mode | STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_PL(3) |
+	       STM32_DMA_CR_TCIE;
+	if(rx_data != NULL) {
+		dmaStreamSetMemory0(dma->rx, rx_data);
+		mode |= STM32_DMA_CR_MINC;
+	} else {
+		dmaStreamSetMemory0(dma->rx, &spi_dma_rx_dummy);
+	}
+	dmaStreamSetPeripheral(dma->rx, &spi->DR);
+	dmaStreamSetTransactionSize(dma->rx, len);
+	dmaStreamSetMode(dma->rx, mode);
+
+	if(dma->use_tx) {
+		mode = dma->mode | STM32_DMA_CR_DIR_M2P | STM32_DMA_CR_PL(2);
+		if(tx_data != NULL) {
+			dmaStreamSetMemory0(dma->tx, tx_data);
+			mode |= STM32_DMA_CR_MINC;
+		} else {
+			dmaStreamSetMemory0(dma->tx, &spi_dma_tx_dummy);
+		}
+		dmaStreamSetPeripheral(dma->tx, &spi->DR);
+		dmaStreamSetTransactionSize(dma->tx, len);
+		dmaStreamSetMode(dma->tx, mode);
+	}
+
+	dma->status = BSP_OK;
+	chSemReset(&dma->sem, 0);
+
+	/* Drop a stale byte and clear OVR */
+	(void)spi->DR;
+	(void)spi->SR;
+
+	dmaStreamEnable(dma->rx);
+	spi->CR2 |= SPI_CR2_RXDMAEN;
+	if(dma->use_tx) {
+		dmaStreamEnable(dma->tx);
+		spi->CR2 |= SPI_CR2_TXDMAEN;
+	}
+}
+
+/* Wait for the end of the transfer started by spi_dma_start() */
+static bsp_status_t spi_dma_end(bsp_dev_spi_t dev_num)
+{
+	SPI_TypeDef* spi;
+	spi_dma_t* dma;
+
+	spi = spi_handle[dev_num].Instance;
+	dma = &spi_dma[dev_num];
+
+	dma->status = spi_dma_wait(dma);
+
+	spi->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+	dmaStreamDisable(dma->rx);
+	if(dma->use_tx) {
+		dmaStreamDisable(dma->tx);
+	}
+	return dma->status;
+}
+
+/**
+  * @brief  Full duplex DMA transfer, the calling thread sleeps until the end.
+  * @param  dev_num: SPI dev num.
+  * @param  tx_data: data to send, NULL to send 0xFF.
+  * @param  rx_data: data to receive, NULL to drop received data.
+  * @param  nb_data: Number of data to transfer.
+  * @retval status of the transfer.
+  */
+static bsp_status_t spi_dma_xfer(bsp_dev_spi_t dev_num, const uint8_t* tx_data,
+				 uint8_t* rx_data, uint32_t nb_data)
+{
+	bsp_status_t status;
+	uint32_t len;
+
+	while(nb_data > 0) {
+		len = (nb_data > SPI_DMA_MAX_LEN) ? SPI_DMA_MAX_LEN : nb_data;
+
+		spi_dma_start(dev_num, tx_data, rx_data, len);
+		status = spi_dma_end(dev_num);
+		if(status != BSP_OK)
+			return status;
+
+		nb_data -= len;
+		if(tx_data != NULL)
+			tx_data += len;
+		if(rx_data != NULL)
+			rx_data += len;
+	}
+	return BSP_OK;
+}
+
+/*
+  Register level transfer for short register accesses, master mode only.
+  A master always gets RXNE after writing DR so there is no timeout.
+*/
+static inline bsp_status_t spi_fast_xfer(SPI_TypeDef* spi, const uint8_t* tx_data,
+					 uint8_t* rx_data, uint32_t nb_data)
+{
+	uint32_t i;
+	uint8_t data;
+
+	/* Drop a stale byte and clear OVR */
+	(void)spi->DR;
+	(void)spi->SR;
+
+	for(i = 0; i < nb_data; i++) {
+		spi->DR = (tx_data != NULL) ? tx_data[i] : 0xFF;
+		while((spi->SR & SPI_SR_RXNE) == 0);
+		data = spi->DR;
+		if(rx_data != NULL)
+			rx_data[i] = data;
+	}
+	return BSP_OK;
+}
+
+/* HAL polling transfer, used when the DMA streams are not available */
+static bsp_status_t spi_hal_xfer(bsp_dev_spi_t dev_num, uint8_t* tx_data,
+				 uint8_t* rx_data, uint32_t nb_data)
+{
+	SPI_HandleTypeDef* hspi;
+	bsp_status_t status;
+	uint16_t len;
+
+	hspi = &spi_handle[dev_num];
+	status = BSP_OK;
+	while((nb_data > 0) && (status == BSP_OK)) {
+		len = (nb_data > SPI_DMA_MAX_LEN) ? SPI_DMA_MAX_LEN : nb_data;
+		if(rx_data == NULL) {
+			status = HAL_SPI_Transmit(hspi, tx_data, len, SPIx_TIMEOUT_MAX);
+			tx_data += len;
+		} else if(tx_data == NULL) {
+			status = HAL_SPI_Receive(hspi, rx_data, len, SPIx_TIMEOUT_MAX);
+			rx_data += len;
+		} else {
+			status = HAL_SPI_TransmitReceive(hspi, tx_data, rx_data, len, SPIx_TIMEOUT_MAX);
+			tx_data += len;
+			rx_data += len;
+		}
+		nb_data -= len;
+	}
+	return status;
+}
+
+static bsp_status_t spi_xfer(bsp_dev_spi_t dev_num, uint8_t* tx_data,
+			     uint8_t* rx_data, uint32_t nb_data)
+{
+	bsp_spi_xfer_t xfer;
+	bool master;
+
+	master = (spi_handle[dev_num].Init.Mode == SPI_MODE_MASTER);
+	xfer = spi_xfer_mode[dev_num];
+	/*
+	  The DMA path sleeps on a semaphore, an ISR (HydraNFC TRF7970A
+	  interrupt) uses the register or HAL polling path instead.
+	*/
+	if(port_is_isr_context()) {
+		if(master)
+			return spi_fast_xfer(spi_handle[dev_num].Instance, tx_data, rx_data, nb_data);
+		return spi_hal_xfer(dev_num, tx_data, rx_data, nb_data);
+	}
+	if(xfer == BSP_SPI_XFER_AUTO) {
+		if(master && (nb_data <= SPI_FAST_MAX_LEN))
+			xfer = BSP_SPI_XFER_FAST;
+		else
+			xfer = BSP_SPI_XFER_DMA;
+	}
+
+	if((xfer == BSP_SPI_XFER_FAST) && master)
+		return spi_fast_xfer(spi_handle[dev_num].Instance, tx_data, rx_data, nb_data);
+	if((xfer == BSP_SPI_XFER_DMA) && spi_dma[dev_num].allocated)
+		return spi_dma_xfer(dev_num, tx_data, rx_data, nb_data);
+	return spi_hal_xfer(dev_num, tx_data, rx_data, nb_data);
+}
+
 /**
   * @brief  SPIx error treatment function.
   * @param  dev_num: SPI dev num
@@ -157,8 +535,10 @@ bsp_status_t bsp_spi_init(bsp_dev_spi_t dev_num, mode_config_proto_t* mode_conf)
 	uint32_t cpol;
 	uint32_t cpha;
 	uint32_t gpio_sck_miso_mosi_pull;
+	uint32_t gpio_nss_mode;
 
 	spi_mode_conf[dev_num] = mode_conf;
+	spi_xfer_mode[dev_num] = BSP_SPI_XFER_AUTO;
 	hspi = &spi_handle[dev_num];
 
 	switch(mode_conf->dev_gpio_pull) {
@@ -176,7 +556,13 @@ bsp_status_t bsp_spi_init(bsp_dev_spi_t dev_num, mode_config_proto_t* mode_conf)
 		break;
 	}
 
-	spi_gpio_hw_init(dev_num, gpio_sck_miso_mosi_pull);
+	/* A slave only reads the chip select driven by the master */
+	if(mode_conf->dev_mode == DEV_SPI_SLAVE)
+		gpio_nss_mode = GPIO_MODE_INPUT;
+	else
+		gpio_nss_mode = GPIO_MODE_OUTPUT_PP;
+
+	spi_gpio_hw_init(dev_num, gpio_sck_miso_mosi_pull, gpio_nss_mode);
 
 	__HAL_SPI_RESET_HANDLE_STATE(hspi);
 
@@ -223,6 +609,8 @@ bsp_status_t bsp_spi_init(bsp_dev_spi_t dev_num, mode_config_proto_t* mode_conf)
 	/* Enable SPI peripheral */
 	__HAL_SPI_ENABLE(hspi);
 
+	spi_dma_init(dev_num);
+
 	return status;
 }
 
@@ -238,6 +626,8 @@ bsp_status_t bsp_spi_deinit(bsp_dev_spi_t dev_num)
 
 	hspi = &spi_handle[dev_num];
 
+	spi_dma_deinit(dev_num);
+
 	/* De-initialize the SPI comunication bus */
 	status = HAL_SPI_DeInit(hspi);
 
@@ -287,6 +677,16 @@ uint8_t bsp_spi_get_cs(bsp_dev_spi_t dev_num)
 	}
 }
 
+/**
+  * @brief  Force the transfer method, used to compare them.
+  * @param  dev_num: SPI dev num.
+  * @param  xfer: BSP_SPI_XFER_AUTO to select it from the transfer length.
+  */
+void bsp_spi_set_xfer(bsp_dev_spi_t dev_num, bsp_spi_xfer_t xfer)
+{
+	spi_xfer_mode[dev_num] = xfer;
+}
+
 /**
   * @brief  Checks if the SPI receive buffer is empty
   * @param  dev_num: SPI dev num.
@@ -301,19 +701,17 @@ uint8_t bsp_spi_rxne(bsp_dev_spi_t dev_num)
 }
 
 /**
-  * @brief  Sends a Byte in blocking mode and return the status.
+  * @brief  Sends data in blocking mode and return the status.
   * @param  dev_num: SPI dev num.
   * @param  tx_data: data to send.
   * @param  nb_data: Number of data to send.
   * @retval status of the transfer.
   */
-bsp_status_t bsp_spi_write_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t nb_data)
+bsp_status_t bsp_spi_write_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint32_t nb_data)
 {
-	SPI_HandleTypeDef* hspi;
-	hspi = &spi_handle[dev_num];
-
 	bsp_status_t status;
-	status = HAL_SPI_Transmit(hspi, tx_data, nb_data, SPIx_TIMEOUT_MAX);
+
+	status = spi_xfer(dev_num, tx_data, NULL, nb_data);
 	if(status != BSP_OK) {
 		spi_error(dev_num);
 	}
@@ -321,19 +719,17 @@ bsp_status_t bsp_spi_write_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t n
 }
 
 /**
-  * @brief  Read a Byte in blocking mode and return the status.
+  * @brief  Read data in blocking mode and return the status.
   * @param  dev_num: SPI dev num.
   * @param  rx_data: Data to receive.
   * @param  nb_data: Number of data to receive.
   * @retval status of the transfer.
   */
-bsp_status_t bsp_spi_read_u8(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint8_t nb_data)
+bsp_status_t bsp_spi_read_u8(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data)
 {
-	SPI_HandleTypeDef* hspi;
-	hspi = &spi_handle[dev_num];
-
 	bsp_status_t status;
-	status = HAL_SPI_Receive(hspi, rx_data, nb_data, SPIx_TIMEOUT_MAX);
+
+	status = spi_xfer(dev_num, NULL, rx_data, nb_data);
 	if(status != BSP_OK) {
 		spi_error(dev_num);
 	}
@@ -341,22 +737,216 @@ bsp_status_t bsp_spi_read_u8(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint8_t nb
 }
 
 /**
-  * @brief  Send a byte then Read a byte through the SPI interface.
+  * @brief  Send and Read data at the same time through the SPI interface.
   * @param  tx_data: Data to send.
   * @param  rx_data: Data to receive.
   * @param  nb_data: Number of data to send & receive.
   * @retval status of the transfer.
   */
-bsp_status_t bsp_spi_write_read_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t* rx_data, uint8_t nb_data)
+bsp_status_t bsp_spi_write_read_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t* rx_data, uint32_t nb_data)
 {
-	SPI_HandleTypeDef* hspi;
-	hspi = &spi_handle[dev_num];
+	bsp_status_t status;
 
+	status = spi_xfer(dev_num, tx_data, rx_data, nb_data);
+	if(status != BSP_OK) {
+		spi_error(dev_num);
+	}
+	return status;
+}
+
+/**
+  * @brief  Start reading data, the transfer runs while the caller does
+  *         something else until bsp_spi_wait().
+  * @param  dev_num: SPI dev num.
+  * @param  rx_data: Data to receive.
+  * @param  nb_data: Number of data to receive, 65535 max.
+  * @retval status of the start.
+  */
+/*
+  Without DMA stream or for a too long transfer, the data are read before returning.
+*/
+bsp_status_t bsp_spi_read_u8_start(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data)
+{
+	spi_dma_t* dma;
+
+	dma = &spi_dma[dev_num];
+	if(!dma->allocated || (nb_data > SPI_DMA_MAX_LEN)) {
+		dma->busy = FALSE;
+		dma->status = bsp_spi_read_u8(dev_num, rx_data, nb_data);
+		return dma->status;
+	}
+
+	spi_dma_start(dev_num, NULL, rx_data, nb_data);
+	dma->busy = TRUE;
+	return BSP_OK;
+}
+
+/**
+  * @brief  Wait the end of the transfer started by bsp_spi_read_u8_start().
+  * @param  dev_num: SPI dev num.
+  * @retval status of the transfer.
+  */
+bsp_status_t bsp_spi_wait(bsp_dev_spi_t dev_num)
+{
+	spi_dma_t* dma;
 	bsp_status_t status;
-	status = HAL_SPI_TransmitReceive(hspi, tx_data, rx_data, nb_data, SPIx_TIMEOUT_MAX);
+
+	dma = &spi_dma[dev_num];
+	if(!dma->busy)
+		return dma->status;
+
+	dma->busy = FALSE;
+	status = spi_dma_end(dev_num);
 	if(status != BSP_OK) {
 		spi_error(dev_num);
 	}
 	return status;
 }
 
+/**
+  * @brief  Slave mode: send data from memory with DMA, return at once.
+  * @param  dev_num: SPI dev num.
+  * @param  tx_data: Data to send, sent again from the start until the reset.
+  * @param  nb_data: Number of data, 65536 max.
+  * @param  start: Index of the first data sent.
+  * @retval BSP_ERROR without DMA stream.
+  */
+/*
+  Can be called with interrupts disabled, bsp_spi_slave_reset() stops the transfer.
+  When start is not 0 the TX stream interrupt goes back to tx_data, the
+  wrap is on time if the interrupt is served within two bytes.
+*/
+bsp_status_t bsp_spi_slave_tx_start(bsp_dev_spi_t dev_num, const uint8_t* tx_data,
+				    uint32_t nb_data, uint32_t start)
+{
+	spi_dma_t* dma;
+
+	dma = &spi_dma[dev_num];
+	if(!dma->allocated || (start >= nb_data) ||
+	   (nb_data > SPI_DMA_LOOP_MAX_LEN))
+		return BSP_ERROR;
+
+	dma->tx_loop = tx_data;
+	dma->tx_loop_len = nb_data;
+	if(start == 0) {
+		spi_dma_tx_loop(dma);
+	} else {
+		dmaStreamSetMemory0(dma->tx, tx_data + start);
+		dmaStreamSetTransactionSize(dma->tx, nb_data - start);
+		dmaStreamSetMode(dma->tx, dma->mode | STM32_DMA_CR_DIR_M2P |
+				 STM32_DMA_CR_PL(3) | STM32_DMA_CR_MINC |
+				 STM32_DMA_CR_TCIE);
+		dmaStreamEnable(dma->tx);
+	}
+	spi_handle[dev_num].Instance->CR2 |= SPI_CR2_TXDMAEN;
+
+	return BSP_OK;
+}
+
+/**
+  * @brief  Slave mode: stop the transfer and drop the data already queued.
+  * @param  dev_num: SPI dev num.
+  * @param  tx_data: First byte sent on the next transfer.
+  */
+/*
+  Only a reset empties the TX buffer and the shift register, the SPI
+  configuration is restored afterwards. Can be called with interrupts disabled.
+*/
+void bsp_spi_slave_reset(bsp_dev_spi_t dev_num, uint8_t tx_data)
+{
+	SPI_TypeDef* spi;
+	spi_dma_t* dma;
+	uint32_t cr1, cr2;
+
+	spi = spi_handle[dev_num].Instance;
+	dma = &spi_dma[dev_num];
+
+	cr1 = spi->CR1;
+	cr2 = spi->CR2 & ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+	if(dma->allocated) {
+		dma->tx_loop = NULL;
+		dmaStreamDisable(dma->tx);
+		dmaStreamSetPeripheral(dma->tx, &spi->DR);
+	}
+
+	if(dev_num == BSP_DEV_SPI1) {
+		__SPI1_FORCE_RESET();
+		__SPI1_RELEASE_RESET();
+	} else { /* SPI2 */
+		__SPI2_FORCE_RESET();
+		__SPI2_RELEASE_RESET();
+	}
+	spi->CR2 = cr2;
+	spi->CR1 = cr1;
+	spi->DR = tx_data;
+}
+
+/**
+  * @brief  Start a circular DMA reception, slave mode only.
+  * @param  dev_num: SPI dev num.
+  * @param  rx_data: Ring buffer.
+  * @param  nb_data: Size of the ring buffer, 65535 max.
+  * @retval BSP_ERROR without DMA stream.
+  */
+bsp_status_t bsp_spi_rx_circular_start(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data)
+{
+	SPI_TypeDef* spi;
+	spi_dma_t* dma;
+
+	spi = spi_handle[dev_num].Instance;
+	dma = &spi_dma[dev_num];
+	if(!dma->allocated || (nb_data > SPI_DMA_MAX_LEN))
+		return BSP_ERROR;
+
+	dma->circular = TRUE;
+	dma->circ_len = nb_data;
+	dma->circ_laps = 0;
+	dma->circ_pos = 0;
+
+	dmaStreamSetMemory0(dma->rx, rx_data);
+	dmaStreamSetPeripheral(dma->rx, &spi->DR);
+	dmaStreamSetTransactionSize(dma->rx, nb_data);
+	dmaStreamSetMode(dma->rx, dma->mode | STM32_DMA_CR_DIR_P2M |
+			 STM32_DMA_CR_PL(3) | STM32_DMA_CR_MINC |
+			 STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE |
+			 STM32_DMA_CR_TCIE);
+
+	/* Drop a stale byte and clear OVR */
+	(void)spi->DR;
+	(void)spi->SR;
+
+	dmaStreamEnable(dma->rx);
+	spi->CR2 |= SPI_CR2_RXDMAEN;
+
+	return BSP_OK;
+}
+
+/**
+  * @brief  Number of bytes received since bsp_spi_rx_circular_start().
+  * @param  dev_num: SPI dev num.
+  * @retval Byte count, the last one is at (count - 1) % nb_data in the ring.
+  */
+/*
+  Shall be called with interrupts disabled (chSysLock() or ISR).
+*/
+uint32_t bsp_spi_rx_circular_count(bsp_dev_spi_t dev_num)
+{
+	return spi_dma_circular_count(&spi_dma[dev_num]);
+}
+
+/**
+  * @brief  Stop a circular DMA reception.
+  * @param  dev_num: SPI dev num.
+  */
+void bsp_spi_rx_circular_stop(bsp_dev_spi_t dev_num)
+{
+	spi_dma_t* dma;
+
+	dma = &spi_dma[dev_num];
+	if(!dma->circular)
+		return;
+
+	spi_handle[dev_num].Instance->CR2 &= ~SPI_CR2_RXDMAEN;
+	dmaStreamDisable(dma->rx);
+	dma->circular = FALSE;
+}
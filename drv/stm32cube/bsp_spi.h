@@ -24,6 +24,14 @@ typedef enum {
 	BSP_DEV_SPI_END = 2
 } bsp_dev_spi_t;
 
+/* Transfer method, AUTO polls the registers for short master transfers and uses DMA otherwise */
+typedef enum {
+	BSP_SPI_XFER_AUTO = 0,
+	BSP_SPI_XFER_HAL,
+	BSP_SPI_XFER_DMA,
+	BSP_SPI_XFER_FAST
+} bsp_spi_xfer_t;
+
 bsp_status_t bsp_spi_init(bsp_dev_spi_t dev_num, mode_config_proto_t* mode_conf);
 bsp_status_t bsp_spi_deinit(bsp_dev_spi_t dev_num);
 
@@ -31,9 +39,24 @@ void bsp_spi_select(bsp_dev_spi_t dev_num);
 void bsp_spi_unselect(bsp_dev_spi_t dev_num);
 uint8_t bsp_spi_get_cs(bsp_dev_spi_t dev_num);
 uint8_t bsp_spi_rxne(bsp_dev_spi_t dev_num);
+void bsp_spi_set_xfer(bsp_dev_spi_t dev_num, bsp_spi_xfer_t xfer);
+
+/* DMA transfers put the calling thread to sleep until the end of the transfer */
+bsp_status_t bsp_spi_write_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint32_t nb_data);
+bsp_status_t bsp_spi_read_u8(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data);
+bsp_status_t bsp_spi_write_read_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t* rx_data, uint32_t nb_data);
+
+/* Background read, the thread can work until bsp_spi_wait() */
+bsp_status_t bsp_spi_read_u8_start(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data);
+bsp_status_t bsp_spi_wait(bsp_dev_spi_t dev_num);
+
+/* Slave transmit driven by the master clock, for device emulation */
+bsp_status_t bsp_spi_slave_tx_start(bsp_dev_spi_t dev_num, const uint8_t* tx_data, uint32_t nb_data, uint32_t start);
+void bsp_spi_slave_reset(bsp_dev_spi_t dev_num, uint8_t tx_data);
 
-bsp_status_t bsp_spi_write_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t nb_data);
-bsp_status_t bsp_spi_read_u8(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint8_t nb_data);
-bsp_status_t bsp_spi_write_read_u8(bsp_dev_spi_t dev_num, uint8_t* tx_data, uint8_t* rx_data, uint8_t nb_data);
+/* Continuous slave reception into a ring buffer, for sniffing */
+bsp_status_t bsp_spi_rx_circular_start(bsp_dev_spi_t dev_num, uint8_t* rx_data, uint32_t nb_data);
+uint32_t bsp_spi_rx_circular_count(bsp_dev_spi_t dev_num);
+void bsp_spi_rx_circular_stop(bsp_dev_spi_t dev_num);
 
 #endif /* _BSP_SPI_H_ */
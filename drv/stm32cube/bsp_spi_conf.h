@@ -32,6 +32,10 @@ limitations under the License.
 /* SPI1 MOSI */
 #define BSP_SPI1_MOSI_PORT    GPIOB
 #define BSP_SPI1_MOSI_PIN     GPIO_PIN_5  /* PB.05 */
+/* SPI1 DMA (DMA2 Stream3 is reserved for SDIO) */
+#define BSP_SPI1_DMA_RX_STREAM STM32_DMA_STREAM_ID(2, 0)
+#define BSP_SPI1_DMA_TX_STREAM STM32_DMA_STREAM_ID(2, 5)
+#define BSP_SPI1_DMA_CHANNEL  3
 
 /* SPI2 */
 #define BSP_SPI2              SPI2
@@ -49,6 +53,10 @@ limitations under the License.
 /* SPI2 MOSI */
 #define BSP_SPI2_MOSI_PORT    GPIOC
 #define BSP_SPI2_MOSI_PIN     GPIO_PIN_3 /* PC.03 */
+/* SPI2 DMA */
+#define BSP_SPI2_DMA_RX_STREAM STM32_DMA_STREAM_ID(1, 3)
+#define BSP_SPI2_DMA_TX_STREAM STM32_DMA_STREAM_ID(1, 4)
+#define BSP_SPI2_DMA_CHANNEL  0
 
 #endif /* _BSP_SPI_CONF_H_ */
 
@@ -12,6 +12,9 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include <string.h>
+#include "ch.h"
+#include "hal.h"
 #include "bsp_uart.h"
 #include "bsp_uart_conf.h"
 #include "stm32f405xx.h"
@@ -31,6 +34,45 @@ static UART_HandleTypeDef uart_handle[NB_UART];
 static mode_config_proto_t* uart_mode_conf[NB_UART];
 volatile uint16_t dummy_read;
 
+#define UART_IRQ_PRIORITY (6)
+#define UART_DMA_IRQ_PRIORITY (6)
+#define UART_DMA_MAX_LEN (0xFFFF) /* NDTR is 16bits */
+#define UART_DMA_POLL_TICKS (100) /* UBTN is checked every 10ms */
+#define UART_RX_MARKS (128) /* Power of two */
+
+typedef struct {
+	const stm32_dma_stream_t* rx;
+	const stm32_dma_stream_t* tx;
+	uint32_t mode;
+	IRQn_Type irq;
+	bool allocated;
+	/* Circular RX, bytes received = rx_laps * rx_len + rx_pos */
+	bool rx_running;
+	uint8_t* rx_buf;
+	uint32_t rx_len;
+	uint32_t rx_laps;
+	uint32_t rx_pos;
+	/* Bytes given by bsp_uart_rx_dma_read() and their position in rx_buf */
+	uint32_t rx_read;
+	uint32_t rx_read_pos;
+	/* Bytes overwritten before they were read */
+	uint32_t rx_lost;
+	/* Reception stopped by bsp_uart_init(), restarted by the next init */
+	bool rx_resume;
+	/* Byte count and cycle counter at each RX interrupt */
+	uint32_t mark_count[UART_RX_MARKS];
+	uint32_t mark_cycles[UART_RX_MARKS];
+	uint32_t mark_wr;
+	uint32_t mark_rd;
+	/* Signaled by DMA half/full and by IDLE line */
+	binary_semaphore_t rx_sem;
+	volatile bool tx_busy;
+	volatile bsp_status_t tx_status;
+	binary_semaphore_t tx_sem;
+} uart_dma_t;
+
+static uart_dma_t uart_dma[NB_UART];
+
 /**
   * @brief  Init low level hardware: GPIO, CLOCK, NVIC...
   * @param  dev_num: UART dev num
@@ -111,6 +153,160 @@ static void uart_gpio_hw_deinit(bsp_dev_uart_t dev_num)
 	}
 }
 
+/* Interrupts disabled, called at least twice per lap to see the wraps */
+static uint32_t uart_dma_rx_count(uart_dma_t* dma)
+{
+	uint32_t pos;
+
+	pos = dma->rx_len - dmaStreamGetTransactionSize(dma->rx);
+	if(pos < dma->rx_pos)
+		dma->rx_laps++;
+	dma->rx_pos = pos;
+
+	return (dma->rx_laps * dma->rx_len) + pos;
+}
+
+/* Interrupts disabled, when the marks are not read the last one moves forward */
+static void uart_dma_rx_mark(uart_dma_t* dma)
+{
+	uint32_t i;
+
+	if(dma->mark_wr - dma->mark_rd == UART_RX_MARKS)
+		dma->mark_wr--;
+	i = dma->mark_wr & (UART_RX_MARKS - 1);
+	dma->mark_cycles[i] = DWT->CYCCNT;
+	dma->mark_count[i] = uart_dma_rx_count(dma);
+	dma->mark_wr++;
+}
+
+static void uart_dma_rx_isr(void *p, uint32_t flags)
+{
+	uart_dma_t* dma = p;
+
+	if(flags & (STM32_DMA_ISR_HTIF | STM32_DMA_ISR_TCIF)) {
+		chSysLockFromISR();
+		uart_dma_rx_mark(dma);
+		chBSemSignalI(&dma->rx_sem);
+		chSysUnlockFromISR();
+	}
+}
+
+static void uart_dma_tx_isr(void *p, uint32_t flags)
+{
+	uart_dma_t* dma = p;
+
+	dma->tx_status = (flags & STM32_DMA_ISR_TEIF) ? BSP_ERROR : BSP_OK;
+
+	chSysLockFromISR();
+	dma->tx_busy = FALSE;
+	chBSemSignalI(&dma->tx_sem);
+	chSysUnlockFromISR();
+}
+
+/* IDLE line, wake up the reader at the end of a burst shorter than half the ring */
+static void uart_serve_irq(bsp_dev_uart_t dev_num)
+{
+	USART_TypeDef* usart;
+	uart_dma_t* dma;
+	uint32_t sr;
+
+	usart = uart_handle[dev_num].Instance;
+	dma = &uart_dma[dev_num];
+
+	sr = usart->SR;
+	if((sr & USART_SR_IDLE) == 0)
+		return;
+
+	/* IDLE is cleared by reading DR, let the DMA do it when a byte is pending */
+	if((sr & USART_SR_RXNE) == 0)
+		(void)usart->DR;
+
+	chSysLockFromISR();
+	if(dma->rx_running) {
+		uart_dma_rx_mark(dma);
+		chBSemSignalI(&dma->rx_sem);
+	}
+	chSysUnlockFromISR();
+}
+
+OSAL_IRQ_HANDLER(STM32_USART1_HANDLER)
+{
+	OSAL_IRQ_PROLOGUE();
+	uart_serve_irq(BSP_DEV_UART1);
+	OSAL_IRQ_EPILOGUE();
+}
+
+OSAL_IRQ_HANDLER(STM32_USART2_HANDLER)
+{
+	OSAL_IRQ_PROLOGUE();
+	uart_serve_irq(BSP_DEV_UART2);
+	OSAL_IRQ_EPILOGUE();
+}
+
+/**
+  * @brief  Allocate the DMA streams of a UART device.
+  * @param  dev_num: UART dev num
+  * @retval None
+  */
+/*
+  When a stream is already used the device falls back to polling.
+*/
+static void uart_dma_init(bsp_dev_uart_t dev_num)
+{
+	uart_dma_t* dma;
+
+	dma = &uart_dma[dev_num];
+	if(dma->allocated)
+		return;
+
+	if(dev_num == BSP_DEV_UART1) {
+		dma->rx = STM32_DMA_STREAM(BSP_UART1_DMA_RX_STREAM);
+		dma->tx = STM32_DMA_STREAM(BSP_UART1_DMA_TX_STREAM);
+		dma->mode = STM32_DMA_CR_CHSEL(BSP_UART1_DMA_CHANNEL);
+		dma->irq = USART1_IRQn;
+	} else {
+		dma->rx = STM32_DMA_STREAM(BSP_UART2_DMA_RX_STREAM);
+		dma->tx = STM32_DMA_STREAM(BSP_UART2_DMA_TX_STREAM);
+		dma->mode = STM32_DMA_CR_CHSEL(BSP_UART2_DMA_CHANNEL);
+		dma->irq = USART2_IRQn;
+	}
+	dma->mode |= STM32_DMA_CR_PSIZE_BYTE | STM32_DMA_CR_MSIZE_BYTE |
+		     STM32_DMA_CR_TEIE;
+
+	if(dmaStreamAllocate(dma->rx, UART_DMA_IRQ_PRIORITY,
+			     uart_dma_rx_isr, dma)) {
+		return;
+	}
+	if(dmaStreamAllocate(dma->tx, UART_DMA_IRQ_PRIORITY,
+			     uart_dma_tx_isr, dma)) {
+		dmaStreamRelease(dma->rx);
+		return;
+	}
+	chBSemObjectInit(&dma->rx_sem, TRUE);
+	chBSemObjectInit(&dma->tx_sem, TRUE);
+	dma->tx_busy = FALSE;
+	dma->allocated = TRUE;
+
+	nvicEnableVector(dma->irq, UART_IRQ_PRIORITY);
+}
+
+static void uart_dma_deinit(bsp_dev_uart_t dev_num)
+{
+	uart_dma_t* dma;
+
+	dma = &uart_dma[dev_num];
+	if(!dma->allocated)
+		return;
+
+	nvicDisableVector(dma->irq);
+	bsp_uart_rx_dma_stop(dev_num);
+	dmaStreamDisable(dma->tx);
+	dma->tx_busy = FALSE;
+	dmaStreamRelease(dma->rx);
+	dmaStreamRelease(dma->tx);
+	dma->allocated = FALSE;
+}
+
 /**
   * @brief  UARTx error treatment function.
   * @param  dev_num: UART dev num
@@ -134,10 +330,24 @@ bsp_status_t bsp_uart_init(bsp_dev_uart_t dev_num, mode_config_proto_t* mode_con
 {
 	UART_HandleTypeDef* huart;
 	bsp_status_t status;
+	bool rx_dma;
+
+	/* Check baudrate is not too low */
+	if(mode_conf->dev_speed < 81)
+		return BSP_ERROR;
 
 	uart_mode_conf[dev_num] = mode_conf;
 	huart = &uart_handle[dev_num];
 
+	/*
+	  A new configuration keeps the circular reception running, a failed
+	  init leaves it to the next successful one.
+	*/
+	rx_dma = uart_dma[dev_num].rx_running || uart_dma[dev_num].rx_resume;
+	bsp_uart_write_dma_wait(dev_num);
+	bsp_uart_rx_dma_stop(dev_num);
+	uart_dma[dev_num].rx_resume = rx_dma;
+
 	uart_gpio_hw_init(dev_num);
 
 	__HAL_UART_RESET_HANDLE_STATE(huart);
@@ -154,10 +364,6 @@ bsp_status_t bsp_uart_init(bsp_dev_uart_t dev_num, mode_config_proto_t* mode_con
 	else
 		huart->Init.OverSampling = UART_OVERSAMPLING_8;
 
-	/* Check baudrate is not too low */
-	if(huart->Init.BaudRate < 81)
-		return BSP_ERROR;
-
 	switch(mode_conf->dev_parity) {
 	case 1: /* 8/even */
 		huart->Init.Parity = UART_PARITY_EVEN;
@@ -189,6 +395,14 @@ bsp_status_t bsp_uart_init(bsp_dev_uart_t dev_num, mode_config_proto_t* mode_con
 	/* Dummy read to flush old character */
 	dummy_read = huart->Instance->DR;
 
+	if(status == BSP_OK) {
+		uart_dma_init(dev_num);
+		if(uart_dma[dev_num].rx_resume) {
+			bsp_uart_rx_dma_start(dev_num, uart_dma[dev_num].rx_buf,
+					      uart_dma[dev_num].rx_len);
+		}
+	}
+
 	return status;
 }
 
@@ -204,6 +418,8 @@ bsp_status_t bsp_uart_deinit(bsp_dev_uart_t dev_num)
 
 	huart = &uart_handle[dev_num];
 
+	uart_dma_deinit(dev_num);
+
 	/* De-initialize the UART comunication bus */
 	status = HAL_UART_DeInit(huart);
 
@@ -334,3 +550,387 @@ uint32_t bsp_uart_get_final_baudrate(bsp_dev_uart_t dev_num)
 	}
 	return final_baudrate;
 }
+
+/**
+  * @brief  Start the reception of the UART in a ring buffer by circular DMA.
+  * @param  dev_num: UART dev num.
+  * @param  rx_data: Ring buffer, shall be DMA capable (not in CCM).
+  * @param  nb_data: Size of the ring buffer.
+  * @retval status: BSP_ERROR without DMA stream, data are then polled.
+  */
+bsp_status_t bsp_uart_rx_dma_start(bsp_dev_uart_t dev_num, uint8_t* rx_data, uint32_t nb_data)
+{
+	USART_TypeDef* usart;
+	uart_dma_t* dma;
+
+	usart = uart_handle[dev_num].Instance;
+	dma = &uart_dma[dev_num];
+	if(!dma->allocated || (nb_data == 0) || (nb_data > UART_DMA_MAX_LEN))
+		return BSP_ERROR;
+
+	bsp_uart_rx_dma_stop(dev_num);
+
+	dma->rx_buf = rx_data;
+	dma->rx_len = nb_data;
+	dma->rx_laps = 0;
+	dma->rx_pos = 0;
+	dma->rx_read = 0;
+	dma->rx_read_pos = 0;
+	dma->rx_lost = 0;
+	dma->mark_wr = 0;
+	dma->mark_rd = 0;
+	chBSemReset(&dma->rx_sem, TRUE);
+
+	dmaStreamSetMemory0(dma->rx, rx_data);
+	dmaStreamSetPeripheral(dma->rx, &usart->DR);
+	dmaStreamSetTransactionSize(dma->rx, nb_data);
+	dmaStreamSetMode(dma->rx, dma->mode | STM32_DMA_CR_DIR_P2M |
+			 STM32_DMA_CR_PL(3) | STM32_DMA_CR_MINC |
+			 STM32_DMA_CR_CIRC | STM32_DMA_CR_HTIE |
+			 STM32_DMA_CR_TCIE);
+
+	/* Drop a stale byte and clear ORE */
+	(void)usart->SR;
+	(void)usart->DR;
+
+	dma->rx_running = TRUE;
+	dmaStreamEnable(dma->rx);
+	usart->CR3 |= USART_CR3_DMAR;
+	usart->CR1 |= USART_CR1_IDLEIE;
+
+	return BSP_OK;
+}
+
+/**
+  * @brief  Read the bytes received since the last call.
+  * @param  dev_num: UART dev num.
+  * @param  rx_data: Data received.
+  * @param  nb_data: Max number of data to read.
+  * @param  timeout: Ticks to wait when nothing is pending.
+  * @retval Number of data read.
+  */
+/*
+  When the reader is more than one ring behind, the oldest data are lost.
+  Without bsp_uart_rx_dma_start() the data pending in the UART are polled.
+*/
+uint32_t bsp_uart_rx_dma_read(bsp_dev_uart_t dev_num, uint8_t* rx_data, uint32_t nb_data, uint32_t timeout)
+{
+	USART_TypeDef* usart;
+	uart_dma_t* dma;
+	uint32_t len, first, pos;
+
+	usart = uart_handle[dev_num].Instance;
+	dma = &uart_dma[dev_num];
+
+	if(!dma->rx_running) {
+		len = 0;
+		while((len < nb_data) && (usart->SR & USART_SR_RXNE)) {
+			rx_data[len++] = usart->DR;
+		}
+		if(len == 0)
+			chThdYield();
+		return len;
+	}
+
+	chSysLock();
+	chBSemResetI(&dma->rx_sem, TRUE);
+	len = uart_dma_rx_count(dma) - dma->rx_read;
+	if(len == 0) {
+		chBSemWaitTimeoutS(&dma->rx_sem, (systime_t)timeout);
+		len = uart_dma_rx_count(dma) - dma->rx_read;
+	}
+	pos = dma->rx_pos;
+	chSysUnlock();
+
+	if(len > dma->rx_len) {
+		/* Overrun, restart from the oldest byte still in the ring */
+		dma->rx_lost += len - dma->rx_len;
+		dma->rx_read += len - dma->rx_len;
+		dma->rx_read_pos = pos;
+		len = dma->rx_len;
+	}
+	if(len > nb_data)
+		len = nb_data;
+
+	first = dma->rx_len - dma->rx_read_pos;
+	if(first > len)
+		first = len;
+	memcpy(rx_data, &dma->rx_buf[dma->rx_read_pos], first);
+	memcpy(&rx_data[first], dma->rx_buf, len - first);
+
+	dma->rx_read += len;
+	dma->rx_read_pos += len;
+	if(dma->rx_read_pos >= dma->rx_len)
+		dma->rx_read_pos -= dma->rx_len;
+
+	return len;
+}
+
+/**
+  * @brief  Oldest RX mark not read yet.
+  * @param  dev_num: UART dev num.
+  * @param  count: Bytes received since bsp_uart_rx_dma_start() at the mark.
+  * @param  cycles: Cycle counter (DWT CYCCNT) at the mark.
+  * @retval FALSE when there is no new mark.
+  */
+/*
+  A mark is recorded by the DMA half/full ring and IDLE line interrupts,
+  it gives the time of the end of a burst without polling delay.
+*/
+bool bsp_uart_rx_dma_mark(bsp_dev_uart_t dev_num, uint32_t* count, uint32_t* cycles)
+{
+	uart_dma_t* dma;
+	uint32_t i;
+	bool ret;
+
+	dma = &uart_dma[dev_num];
+
+	chSysLock();
+	ret = (dma->mark_rd != dma->mark_wr);
+	if(ret) {
+		i = dma->mark_rd & (UART_RX_MARKS - 1);
+		*count = dma->mark_count[i];
+		*cycles = dma->mark_cycles[i];
+		dma->mark_rd++;
+	}
+	chSysUnlock();
+
+	return ret;
+}
+
+/**
+  * @brief  Number of bytes lost since bsp_uart_rx_dma_start().
+  * @param  dev_num: UART dev num.
+  * @retval Bytes overwritten in the ring before bsp_uart_rx_dma_read().
+  */
+uint32_t bsp_uart_rx_dma_lost(bsp_dev_uart_t dev_num)
+{
+	return uart_dma[dev_num].rx_lost;
+}
+
+void bsp_uart_rx_dma_stop(bsp_dev_uart_t dev_num)
+{
+	USART_TypeDef* usart;
+	uart_dma_t* dma;
+
+	dma = &uart_dma[dev_num];
+	dma->rx_resume = FALSE;
+	if(!dma->rx_running)
+		return;
+
+	usart = uart_handle[dev_num].Instance;
+	usart->CR1 &= ~USART_CR1_IDLEIE;
+	usart->CR3 &= ~USART_CR3_DMAR;
+	dmaStreamDisable(dma->rx);
+	dma->rx_running = FALSE;
+}
+
+/**
+  * @brief  Start sending data by DMA once the previous transfer is over.
+  * @param  dev_num: UART dev num.
+  * @param  tx_data: Data to send, shall stay valid until the next call
+  *                  or bsp_uart_write_dma_wait().
+  * @param  nb_data: Number of data to send.
+  * @retval status of the previous transfer.
+  */
+bsp_status_t bsp_uart_write_dma(bsp_dev_uart_t dev_num, const uint8_t* tx_data, uint32_t nb_data)
+{
+	UART_HandleTypeDef* huart;
+	uart_dma_t* dma;
+	bsp_status_t status;
+
+	huart = &uart_handle[dev_num];
+	dma = &uart_dma[dev_num];
+
+	if(nb_data > UART_DMA_MAX_LEN)
+		return BSP_ERROR;
+
+	if(!dma->allocated) {
+		status = HAL_UART_Transmit(huart, (uint8_t*)tx_data, nb_data, UARTx_TIMEOUT_MAX);
+		if(status != BSP_OK) {
+			uart_error(dev_num);
+		}
+		return status;
+	}
+
+	status = bsp_uart_write_dma_wait(dev_num);
+	if((status != BSP_OK) || (nb_data == 0))
+		return status;
+
+	dmaStreamSetMemory0(dma->tx, tx_data);
+	dmaStreamSetPeripheral(dma->tx, &huart->Instance->DR);
+	dmaStreamSetTransactionSize(dma->tx, nb_data);
+	dmaStreamSetMode(dma->tx, dma->mode | STM32_DMA_CR_DIR_M2P |
+			 STM32_DMA_CR_PL(2) | STM32_DMA_CR_MINC |
+			 STM32_DMA_CR_TCIE);
+
+	chBSemReset(&dma->tx_sem, TRUE);
+	dma->tx_busy = TRUE;
+	dmaStreamEnable(dma->tx);
+	huart->Instance->CR3 |= USART_CR3_DMAT;
+
+	return BSP_OK;
+}
+
+/**
+  * @brief  Wait for the end of the transfer started by bsp_uart_write_dma().
+  * @param  dev_num: UART dev num.
+  * @retval status of the transfer.
+  */
+bsp_status_t bsp_uart_write_dma_wait(bsp_dev_uart_t dev_num)
+{
+	uart_dma_t* dma;
+	uint32_t ticks;
+
+	dma = &uart_dma[dev_num];
+
+	ticks = 0;
+	while(dma->tx_busy) {
+		if(chBSemWaitTimeout(&dma->tx_sem, UART_DMA_POLL_TICKS) == MSG_OK)
+			continue;
+		ticks += UART_DMA_POLL_TICKS;
+		if(USER_BUTTON || (ticks >= UARTx_TIMEOUT_MAX)) {
+			uart_handle[dev_num].Instance->CR3 &= ~USART_CR3_DMAT;
+			dmaStreamDisable(dma->tx);
+			dma->tx_busy = FALSE;
+			return BSP_TIMEOUT;
+		}
+	}
+	return dma->tx_status;
+}
+
+/**
+  * @brief  Timestamp the edges of the RX pin with a timer input capture.
+  * @param  dev_num: UART dev num.
+  * @param  edges: Time of each edge in BSP_UART_CAPTURE_FREQ ticks,
+  *                shall be DMA capable.
+  * @param  nb_edges: Max number of edges to capture.
+  * @param  timeout: Capture duration in ms, from the first edge.
+  * @param  level: RX level before the first edge.
+  * @retval Number of edges captured, 0 on abort by UBTN.
+  */
+/*
+  The first edge is awaited until UBTN is pressed.
+  The RX pin is taken from the UART, bsp_uart_init() shall be called after.
+  TIM1 is 16bits, its captures are extended to 32bits while polling every
+  system tick (the polling period shall stay below one counter period, 780us).
+*/
+uint32_t bsp_uart_capture_edges(bsp_dev_uart_t dev_num, uint32_t* edges, uint32_t nb_edges, uint32_t timeout, uint8_t* level)
+{
+	GPIO_InitTypeDef GPIO_InitStructure;
+	const stm32_dma_stream_t* dma;
+	TIM_TypeDef* tim;
+	GPIO_TypeDef* port;
+	volatile uint32_t* ccr;
+	uint32_t pin, mode, nb, done, hi, cnt, now;
+	systime_t start;
+	bool started;
+
+	if((nb_edges == 0) || (nb_edges > UART_DMA_MAX_LEN))
+		return 0;
+
+	bsp_uart_rx_dma_stop(dev_num);
+
+	GPIO_InitStructure.Mode = GPIO_MODE_AF_PP;
+	GPIO_InitStructure.Pull  = GPIO_NOPULL;
+	if(dev_num == BSP_DEV_UART1) {
+		__TIM1_CLK_ENABLE();
+		__TIM1_FORCE_RESET();
+		__TIM1_RELEASE_RESET();
+		tim = BSP_UART1_CAPTURE_TIMER;
+		port = BSP_UART1_RX_PORT;
+		pin = BSP_UART1_RX_PIN;
+		GPIO_InitStructure.Speed = BSP_UART1_GPIO_SPEED;
+		GPIO_InitStructure.Alternate = BSP_UART1_CAPTURE_AF;
+		dma = STM32_DMA_STREAM(BSP_UART1_CAPTURE_DMA_STREAM);
+		mode = STM32_DMA_CR_CHSEL(BSP_UART1_CAPTURE_DMA_CHANNEL);
+		/* APB2 timer clock is 168MHz */
+		tim->PSC = 1;
+		tim->ARR = 0xFFFF;
+		/* CH3 on TI3, both edges, filter N=4 */
+		tim->CCMR2 = TIM_CCMR2_CC3S_0 | TIM_CCMR2_IC3F_1;
+		tim->CCER = TIM_CCER_CC3E | TIM_CCER_CC3P | TIM_CCER_CC3NP;
+		tim->DIER = TIM_DIER_CC3DE;
+		ccr = &tim->CCR3;
+	} else {
+		__TIM2_CLK_ENABLE();
+		__TIM2_FORCE_RESET();
+		__TIM2_RELEASE_RESET();
+		tim = BSP_UART2_CAPTURE_TIMER;
+		port = BSP_UART2_RX_PORT;
+		pin = BSP_UART2_RX_PIN;
+		GPIO_InitStructure.Speed = BSP_UART2_GPIO_SPEED;
+		GPIO_InitStructure.Alternate = BSP_UART2_CAPTURE_AF;
+		dma = STM32_DMA_STREAM(BSP_UART2_CAPTURE_DMA_STREAM);
+		mode = STM32_DMA_CR_CHSEL(BSP_UART2_CAPTURE_DMA_CHANNEL);
+		/* APB1 timer clock is 84MHz */
+		tim->PSC = 0;
+		tim->ARR = 0xFFFFFFFF;
+		/* CH4 on TI4, both edges, filter N=4 */
+		tim->CCMR2 = TIM_CCMR2_CC4S_0 | TIM_CCMR2_IC4F_1;
+		tim->CCER = TIM_CCER_CC4E | TIM_CCER_CC4P | TIM_CCER_CC4NP;
+		tim->DIER = TIM_DIER_CC4DE;
+		ccr = &tim->CCR4;
+	}
+	GPIO_InitStructure.Pin = pin;
+	HAL_GPIO_Init(port, &GPIO_InitStructure);
+
+	if(dmaStreamAllocate(dma, UART_DMA_IRQ_PRIORITY, NULL, NULL)) {
+		tim->DIER = 0;
+		return 0;
+	}
+	dmaStreamSetMemory0(dma, edges);
+	dmaStreamSetPeripheral(dma, ccr);
+	dmaStreamSetTransactionSize(dma, nb_edges);
+	dmaStreamSetMode(dma, mode | STM32_DMA_CR_PSIZE_WORD |
+			 STM32_DMA_CR_MSIZE_WORD | STM32_DMA_CR_DIR_P2M |
+			 STM32_DMA_CR_PL(3) | STM32_DMA_CR_MINC);
+	dmaStreamEnable(dma);
+
+	tim->EGR = TIM_EGR_UG;
+	tim->SR = 0;
+	*level = (port->IDR & pin) ? 1 : 0;
+	tim->CR1 = TIM_CR1_CEN;
+
+	done = 0;
+	hi = 0;
+	started = FALSE;
+	start = chVTGetSystemTime();
+	while(!USER_BUTTON) {
+		/* Edges counted before reading the counter are in the past */
+		nb = nb_edges - dmaStreamGetTransactionSize(dma);
+		if(tim == TIM1) {
+			cnt = tim->CNT;
+			if(tim->SR & TIM_SR_UIF) {
+				tim->SR = ~TIM_SR_UIF;
+				hi += 0x10000;
+				cnt = tim->CNT;
+			}
+			now = hi + cnt;
+			for(; done < nb; done++) {
+				edges[done] = now - ((cnt - edges[done]) & 0xFFFF);
+			}
+			chThdSleep(1);
+		} else {
+			done = nb;
+			chThdSleepMilliseconds(1);
+		}
+
+		if(!started && (done > 0)) {
+			started = TRUE;
+			start = chVTGetSystemTime();
+		}
+		if((done == nb_edges) ||
+		   (started && !chVTIsSystemTimeWithin(start, start + MS2ST(timeout))))
+			break;
+	}
+	if(USER_BUTTON)
+		done = 0;
+
+	tim->CR1 = 0;
+	tim->DIER = 0;
+	dmaStreamDisable(dma);
+	dmaStreamRelease(dma);
+
+	return done;
+}
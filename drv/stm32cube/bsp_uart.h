@@ -18,6 +18,9 @@ limitations under the License.
 #include "bsp.h"
 #include "mode_config.h"
 
+/* Time base of bsp_uart_capture_edges() */
+#define BSP_UART_CAPTURE_FREQ (84000000)
+
 typedef enum {
 	BSP_DEV_UART1 = 0,
 	BSP_DEV_UART2 = 1,
@@ -34,4 +37,14 @@ bsp_status_t bsp_uart_rxne(bsp_dev_uart_t dev_num);
 
 uint32_t bsp_uart_get_final_baudrate(bsp_dev_uart_t dev_num);
 
+bsp_status_t bsp_uart_rx_dma_start(bsp_dev_uart_t dev_num, uint8_t* rx_data, uint32_t nb_data);
+uint32_t bsp_uart_rx_dma_read(bsp_dev_uart_t dev_num, uint8_t* rx_data, uint32_t nb_data, uint32_t timeout);
+bool bsp_uart_rx_dma_mark(bsp_dev_uart_t dev_num, uint32_t* count, uint32_t* cycles);
+uint32_t bsp_uart_rx_dma_lost(bsp_dev_uart_t dev_num);
+void bsp_uart_rx_dma_stop(bsp_dev_uart_t dev_num);
+bsp_status_t bsp_uart_write_dma(bsp_dev_uart_t dev_num, const uint8_t* tx_data, uint32_t nb_data);
+bsp_status_t bsp_uart_write_dma_wait(bsp_dev_uart_t dev_num);
+
+uint32_t bsp_uart_capture_edges(bsp_dev_uart_t dev_num, uint32_t* edges, uint32_t nb_edges, uint32_t timeout, uint8_t* level);
+
 #endif /* _BSP_UART_H_ */
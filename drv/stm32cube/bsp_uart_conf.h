@@ -26,6 +26,15 @@ limitations under the License.
 /* UART1 RX */
 #define BSP_UART1_RX_PORT     GPIOA
 #define BSP_UART1_RX_PIN      GPIO_PIN_10  /* PA.10 */
+/* UART1 DMA */
+#define BSP_UART1_DMA_RX_STREAM STM32_DMA_STREAM_ID(2, 2)
+#define BSP_UART1_DMA_TX_STREAM STM32_DMA_STREAM_ID(2, 7)
+#define BSP_UART1_DMA_CHANNEL  4
+/* UART1 RX edges capture, TIM1 CH3 */
+#define BSP_UART1_CAPTURE_TIMER  TIM1
+#define BSP_UART1_CAPTURE_AF     GPIO_AF1_TIM1
+#define BSP_UART1_CAPTURE_DMA_STREAM STM32_DMA_STREAM_ID(2, 6)
+#define BSP_UART1_CAPTURE_DMA_CHANNEL 6
 
 /* UART2 */
 #define BSP_UART2              USART2
@@ -37,5 +46,14 @@ limitations under the License.
 /* UART2 RX */
 #define BSP_UART2_RX_PORT     GPIOA
 #define BSP_UART2_RX_PIN      GPIO_PIN_3 /* PA.03 */
+/* UART2 DMA */
+#define BSP_UART2_DMA_RX_STREAM STM32_DMA_STREAM_ID(1, 5)
+#define BSP_UART2_DMA_TX_STREAM STM32_DMA_STREAM_ID(1, 6)
+#define BSP_UART2_DMA_CHANNEL  4
+/* UART2 RX edges capture, TIM2 CH4 (shared with PWM) */
+#define BSP_UART2_CAPTURE_TIMER  TIM2
+#define BSP_UART2_CAPTURE_AF     GPIO_AF1_TIM2
+#define BSP_UART2_CAPTURE_DMA_STREAM STM32_DMA_STREAM_ID(1, 7)
+#define BSP_UART2_CAPTURE_DMA_CHANNEL 3
 
 #endif /* _BSP_UART_CONF_H_ */
@@ -107,6 +107,7 @@ t_token_dict tl_dict[] = {
 	{ T_TOKENLINE, "tokenline" },
 	{ T_TIMING, "timing" },
 	{ T_DEBUG_TEST_RX, "test-rx" },
+	{ T_DEBUG_SPI_BENCH, "spi-bench" },
 	{ T_RM, "rm" },
 	{ T_MKDIR, "mkdir" },
 	{ T_LOGGING, "logging" },
@@ -141,6 +142,20 @@ t_token_dict tl_dict[] = {
 	{ T_THREEWIRE, "3-wire" },
 	{ T_SCRIPT, "script" },
 	{ T_FILE, "filename" },
+	{ T_STREAM, "stream" },
+	{ T_TIMESTAMP, "timestamp" },
+	{ T_RATES, "rates" },
+	{ T_PATTERN, "pattern" },
+	{ T_UPLOAD, "upload" },
+	{ T_WIDE, "wide" },
+	{ T_FLASH, "flash" },
+	{ T_VERIFY, "verify" },
+	{ T_ADDRESS, "address" },
+	{ T_CRC32, "crc32" },
+	{ T_SHA256, "sha256" },
+	{ T_LENGTH, "length" },
+	{ T_EMUL_FLASH, "emul-flash" },
+	{ T_AUTOBAUD, "autobaud" },
 
 	{ T_LEFT_SQ, "[" },
 	{ T_RIGHT_SQ, "]" },
@@ -402,6 +417,15 @@ t_token tokens_parity[] = {
 		.help = "Stop bits (1/2)"\
 	},
 
+t_token tokens_uart_sniff[] = {
+	{
+		T_FILE,
+		.arg_type = T_ARG_STRING,
+		.help = "Write to microSD file instead of console"
+	},
+	{ }
+};
+
 t_token tokens_mode_uart[] = {
 	{
 		T_SHOW,
@@ -454,6 +478,15 @@ t_token tokens_mode_uart[] = {
 		T_BRIDGE,
 		.help = "UART bridge mode"
 	},
+	{
+		T_AUTOBAUD,
+		.help = "Detect speed and frame format from RX traffic"
+	},
+	{
+		T_SNIFF,
+		.subtokens = tokens_uart_sniff,
+		.help = "Sniff both lines of a link on UART1 RX and UART2 RX"
+	},
 	{
 		T_EXIT,
 		.help = "Exit UART mode"
@@ -595,6 +628,16 @@ t_token tokens_mode_i2c[] = {
 		T_ARG_STRING,
 		.help = "Write string"
 	},
+	{
+		T_CRC32,
+		.flags = T_FLAG_SUFFIX_TOKEN_DELIM_INT,
+		.help = "Read bytes (with :<num>) and print their CRC32"
+	},
+	{
+		T_SHA256,
+		.flags = T_FLAG_SUFFIX_TOKEN_DELIM_INT,
+		.help = "Read bytes (with :<num>) and print their SHA-256"
+	},
 	/* BP commands */
 	{
 		T_LEFT_SQ,
@@ -657,6 +700,59 @@ t_token tokens_i2c[] = {
 	{ T_LSB_FIRST, \
 		.help = "Send/receive LSB first" },
 
+t_token tokens_spi_flash[] = {
+	{
+		T_ID,
+		.help = "Show flash JEDEC ID and size"
+	},
+	{
+		T_FILE,
+		.arg_type = T_ARG_STRING,
+		.help = "microSD image filename"
+	},
+	{
+		T_ADDRESS,
+		.arg_type = T_ARG_UINT,
+		.help = "Flash start address (default 0)"
+	},
+	{
+		T_WRITE,
+		.help = "Erase, program and verify the image"
+	},
+	{
+		T_VERIFY,
+		.help = "Compare the flash with the image"
+	},
+	{
+		T_LENGTH,
+		.arg_type = T_ARG_UINT,
+		.help = "Checksum length (default up to the end)"
+	},
+	{
+		T_CRC32,
+		.help = "CRC32 of the flash"
+	},
+	{
+		T_SHA256,
+		.help = "SHA-256 of the flash"
+	},
+	{ }
+};
+
+t_token tokens_spi_emul_flash[] = {
+	{
+		T_FILE,
+		.arg_type = T_ARG_STRING,
+		.help = "microSD image filename, 64KB max (default erased flash)"
+	},
+	{
+		T_ID,
+		.arg_type = T_ARG_UINT,
+		.help = "JEDEC ID on 3 bytes (default Winbond)"
+	},
+	{ }
+};
+
 t_token tokens_mode_spi[] = {
 	{
 		T_SHOW,
@@ -697,6 +793,16 @@ t_token tokens_mode_spi[] = {
 		T_CS_OFF,
 		.help = "Alias for \"chip-select off\""
 	},
+	{
+		T_FLASH,
+		.subtokens = tokens_spi_flash,
+		.help = "Program, verify or checksum a SPI flash"
+	},
+	{
+		T_EMUL_FLASH,
+		.subtokens = tokens_spi_emul_flash,
+		.help = "Emulate a SPI flash on SPI1 (slave)"
+	},
 	/* BP commands */
 	{
 		T_LEFT_SQ,
@@ -1253,6 +1359,68 @@ t_token tokens_freq[] = {
 	{ }
 };
 
+t_token tokens_sump[] = {
+	{
+		T_STREAM,
+		.help = "Stream PC0-14 samples continuously (16bits little endian)"
+	},
+	{
+		T_FREQUENCY,
+		.arg_type = T_ARG_UINT,
+		.help = "Sample rate in Hz"
+	},
+	{
+		T_TIMESTAMP,
+		.help = "SUMP mode recording timestamped transitions of PC0-14"
+	},
+	{
+		T_RATES,
+		.help = "Show the exact sample rates used for the OLS rates"
+	},
+	{
+		T_FILE,
+		.arg_type = T_ARG_STRING,
+		.help = "Capture to a microSD file, VCD or sigrok session (.sr)"
+	},
+	{
+		T_SAMPLES,
+		.arg_type = T_ARG_UINT,
+		.help = "Number of samples saved from the trigger"
+	},
+	{ }
+};
+
+t_token tokens_pattern[] = {
+	{
+		T_FILE,
+		.arg_type = T_ARG_STRING,
+		.help = "Play samples from a microSD file"
+	},
+	{
+		T_SUMP,
+		.help = "Play the last SUMP capture"
+	},
+	{
+		T_UPLOAD,
+		.arg_type = T_ARG_UINT,
+		.help = "Play samples sent by the host (nb samples)"
+	},
+	{
+		T_WIDE,
+		.help = "32 bits samples, GPIOB on the upper 16 bits"
+	},
+	{
+		T_FREQUENCY,
+		.arg_type = T_ARG_UINT,
+		.help = "Sample rate in Hz"
+	},
+	{
+		T_CONTINUOUS,
+		.help = "Loop until the user button is pressed"
+	},
+	{ }
+};
+
 
 t_token tokens_really[] = {
 	{ T_REALLY },
@@ -1344,6 +1512,10 @@ t_token tokens_debug[] = {
 		T_DEBUG_TEST_RX,
 		.help = "Test USB1 or 2 RX(read all data until UBTN+Key pressed)"
 	},
+	{
+		T_DEBUG_SPI_BENCH,
+		.help = "Measure SPI1 transfer overhead in CPU cycles"
+	},
 	{
 		T_ON,
 		.help = "Enable"
@@ -1471,8 +1643,15 @@ t_token tl_tokens[] = {
 	},
 	{
 		T_SUMP,
+		.subtokens = tokens_sump,
 		.help = "SUMP mode"
 	},
+	{
+		T_PATTERN,
+		.subtokens = tokens_pattern,
+		.help = "Pattern generator",
+		.help_full = "Usage: pattern <filename (file)/sump/upload (nb samples)> [wide] [frequency (value in Hz)] [continuous]\r\nPlays PC0-7, PC13-14 (and PB0-11 with wide) samples, PC8-12 are kept for the microSD, interrupt by pressing user button"
+	},
 	{
 		T_JTAG,
 		.subtokens = tokens_jtag,
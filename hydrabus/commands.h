@@ -100,6 +100,7 @@ enum {
 	T_TOKENLINE,
 	T_TIMING,
 	T_DEBUG_TEST_RX,
+	T_DEBUG_SPI_BENCH,
 	T_RM,
 	T_MKDIR,
 	T_LOGGING,
@@ -134,6 +135,20 @@ enum {
 	T_THREEWIRE,
 	T_SCRIPT,
 	T_FILE,
+	T_STREAM,
+	T_TIMESTAMP,
+	T_RATES,
+	T_PATTERN,
+	T_UPLOAD,
+	T_WIDE,
+	T_FLASH,
+	T_VERIFY,
+	T_ADDRESS,
+	T_CRC32,
+	T_SHA256,
+	T_LENGTH,
+	T_EMUL_FLASH,
+	T_AUTOBAUD,
 
 	/* BP-compatible commands */
 	T_LEFT_SQ,
@@ -7,9 +7,16 @@ HYDRABUSSRC = hydrabus/hydrabus.c \
             hydrabus/gpio.c \
             hydrabus/hydrabus_mode.c \
             hydrabus/hydrabus_mode_spi.c \
+            hydrabus/hydrabus_spi_flash.c \
+            hydrabus/hydrabus_checksum.c \
             hydrabus/hydrabus_mode_uart.c \
+            hydrabus/hydrabus_uart_autobaud.c \
+            hydrabus/hydrabus_uart_sniff.c \
             hydrabus/hydrabus_mode_i2c.c \
             hydrabus/hydrabus_sump.c \
+            hydrabus/hydrabus_sump_trigger.c \
+            hydrabus/hydrabus_sump_file.c \
+            hydrabus/hydrabus_pattern.c \
             hydrabus/hydrabus_mode_jtag.c \
             hydrabus/hydrabus_rng.c \
             hydrabus/hydrabus_mode_twowire.c \
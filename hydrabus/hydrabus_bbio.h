@@ -46,6 +46,9 @@
 #define BBIO_SPI_CS_HIGH	0b00000011
 #define BBIO_SPI_WRITE_READ	0b00000100
 #define BBIO_SPI_WRITE_READ_NCS	0b00000101
+#define BBIO_SPI_FLASH_DUMP	0b00000110
+#define BBIO_SPI_FLASH_CHECKSUM	0b00000111
+#define BBIO_SPI_SNIFF_DMA	0b00001100
 #define BBIO_SPI_SNIFF_ALL	0b00001101
 #define BBIO_SPI_SNIFF_CS_LOW	0b00001110
 #define BBIO_SPI_SNIFF_CS_HIGH	0b00001111
@@ -61,9 +64,11 @@
 #define BBIO_I2C_START_BIT	0b00000010
 #define BBIO_I2C_STOP_BIT	0b00000011
 #define BBIO_I2C_READ_BYTE	0b00000100
+#define BBIO_I2C_CHECKSUM	0b00000101
 #define BBIO_I2C_ACK_BIT	0b00000110
 #define BBIO_I2C_NACK_BIT	0b00000111
 #define BBIO_I2C_WRITE_READ	0b00001000
+#define BBIO_I2C_START_SNIFF_TS	0b00001110
 #define BBIO_I2C_START_SNIFF	0b00001111
 #define BBIO_I2C_BULK_WRITE	0b00010000
 #define BBIO_I2C_CONFIG_PERIPH	0b01000000
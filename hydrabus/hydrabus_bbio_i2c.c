@@ -26,6 +26,7 @@
 
 #include "hydrabus_bbio.h"
 #include "bsp_i2c.h"
+#include "hydrabus_checksum.h"
 
 #define I2C_DEV_NUM (1)
 
@@ -40,10 +41,311 @@ void bbio_i2c_init_proto_default(t_hydra_console *con)
 	proto->ack_pending = 0;
 }
 
-void bbio_i2c_sniff(t_hydra_console *con)
+/*
+ * Passive sniffer on SCL (PB6) and SDA (PB7).
+ * EXTI on SCL rising edges samples the data bits. SDA edges are only
+ * unmasked while SCL is high, so that only START and STOP interrupt.
+ * The ISR just queues the events with their time in CPU cycles, bytes and
+ * ACK are decoded by a thread which sends the Bus Pirate sniffer stream
+ * in batches:
+ * '[' START, ']' STOP, '\' followed by the byte, '+' ACK, '-' NACK,
+ * and '!' where events were lost because the ring was full.
+ * With timestamps, '[', ']' and the byte are followed by the time of the
+ * START, STOP or first data bit, and '!' by the number of events lost so
+ * far, 4 bytes MSB first.
+ */
+#define SNIFF_SCL_LINE		6
+#define SNIFF_SDA_LINE		7
+#define SNIFF_SCL		(1 << SNIFF_SCL_LINE)
+#define SNIFF_SDA		(1 << SNIFF_SDA_LINE)
+#define SNIFF_RING_SIZE		(8192)
+#define SNIFF_TX_SIZE		(16384)
+/* Wake up the thread at least every SNIFF_WAKEUP events */
+#define SNIFF_WAKEUP		(256)
+
+#define SNIFF_EVENT_BIT0	0
+#define SNIFF_EVENT_BIT1	1
+#define SNIFF_EVENT_START	2
+#define SNIFF_EVENT_STOP	3
+#define SNIFF_EVENT_LOST	4
+
+static uint32_t *sniff_time = (uint32_t *)g_sbuf;
+static uint8_t *sniff_ring = (uint8_t *)g_sbuf + (4 * SNIFF_RING_SIZE);
+static volatile uint32_t sniff_wr;
+static volatile uint32_t sniff_rd;
+static volatile uint32_t sniff_lost;
+static binary_semaphore_t sniff_sem;
+static bool sniff_timestamps;
+static EXTConfig sniff_extcfg;
+
+/* SCL and SDA share the EXTI9_5 vector, there is a single writer */
+static inline void sniff_push(uint8_t event, uint32_t time)
+{
+	uint32_t wr, n;
+
+	wr = sniff_wr;
+	n = wr - sniff_rd;
+	if(n >= SNIFF_RING_SIZE) {
+		sniff_lost++;
+		return;
+	}
+	/* The last free slot marks where events start to be lost */
+	if(n == SNIFF_RING_SIZE - 1) {
+		sniff_lost++;
+		event = SNIFF_EVENT_LOST;
+	}
+	sniff_ring[wr % SNIFF_RING_SIZE] = event;
+	sniff_time[wr % SNIFF_RING_SIZE] = time;
+	sniff_wr = ++wr;
+
+	if((event >= SNIFF_EVENT_STOP) || ((wr % SNIFF_WAKEUP) == 0)) {
+		chSysLockFromISR();
+		chBSemSignalI(&sniff_sem);
+		chSysUnlockFromISR();
+	}
+}
+
+static void sniff_scl_cb(EXTDriver *extp, expchannel_t channel)
+{
+	uint32_t time, idr;
+
+	(void)extp;
+	(void)channel;
+
+	time = get_cyclecounter();
+	idr = GPIOB->IDR;
+	sniff_push((idr & SNIFF_SDA) ? SNIFF_EVENT_BIT1 : SNIFF_EVENT_BIT0, time);
+	/* Watch SDA until SCL goes low, drop an edge seen while masked */
+	EXTI->PR = SNIFF_SDA;
+	EXTI->IMR |= SNIFF_SDA;
+}
+
+static void sniff_sda_cb(EXTDriver *extp, expchannel_t channel)
+{
+	uint32_t time, idr;
+
+	(void)extp;
+	(void)channel;
+
+	time = get_cyclecounter();
+	idr = GPIOB->IDR;
+	if(idr & SNIFF_SCL) {
+		sniff_push((idr & SNIFF_SDA) ? SNIFF_EVENT_STOP : SNIFF_EVENT_START, time);
+	} else {
+		/* Data change, SCL is low */
+		EXTI->IMR &= ~SNIFF_SDA;
+	}
+}
+
+static uint32_t sniff_put(uint8_t *buf, uint8_t token, uint32_t value)
 {
-	(void)con;
-	/* TODO bbio_i2c_sniff code */
+	buf[0] = token;
+	if(!sniff_timestamps) {
+		return 1;
+	}
+	buf[1] = value >> 24;
+	buf[2] = value >> 16;
+	buf[3] = value >> 8;
+	buf[4] = value;
+	return 5;
+}
+
+static msg_t sniff_thread(void *arg)
+{
+	t_hydra_console *con;
+	uint8_t *tx_data = (uint8_t *)g_sbuf + (5 * SNIFF_RING_SIZE);
+	uint32_t len, nb_bits, time, byte_time, lost;
+	uint8_t event, byte;
+	bool synced;
+
+	con = arg;
+	chRegSetThreadName("I2C sniffer");
+	len = 0;
+	nb_bits = 0;
+	byte = 0;
+	byte_time = 0;
+	lost = 0;
+	synced = TRUE;
+
+	while(!chThdShouldTerminateX() || (sniff_rd != sniff_wr)) {
+		if(sniff_rd == sniff_wr) {
+			if(len > 0) {
+				cprint(con, (char *)tx_data, len);
+				len = 0;
+			}
+			chBSemWaitTimeout(&sniff_sem, MS2ST(10));
+			continue;
+		}
+		event = sniff_ring[sniff_rd % SNIFF_RING_SIZE];
+		time = sniff_time[sniff_rd % SNIFF_RING_SIZE];
+		sniff_rd++;
+
+		switch(event) {
+		case SNIFF_EVENT_START:
+			len += sniff_put(tx_data + len, '[', time);
+			nb_bits = 0;
+			byte = 0;
+			synced = TRUE;
+			break;
+		case SNIFF_EVENT_STOP:
+			len += sniff_put(tx_data + len, ']', time);
+			nb_bits = 0;
+			synced = TRUE;
+			break;
+		case SNIFF_EVENT_LOST:
+			/* Bits are meaningless until the next START or STOP */
+			lost = sniff_lost;
+			len += sniff_put(tx_data + len, '!', lost);
+			synced = FALSE;
+			break;
+		default:
+			if(!synced) {
+				break;
+			}
+			if(nb_bits < 8) {
+				if(nb_bits == 0) {
+					byte_time = time;
+				}
+				byte = (byte << 1) | event;
+				if(++nb_bits == 8) {
+					len += sniff_put(tx_data + len, '\\', byte_time);
+					tx_data[len++] = byte;
+				}
+			} else {
+				/* ACK is SDA low */
+				tx_data[len++] = event ? '-' : '+';
+				nb_bits = 0;
+				byte = 0;
+			}
+			break;
+		}
+
+		if(len > SNIFF_TX_SIZE - 6) {
+			cprint(con, (char *)tx_data, len);
+			len = 0;
+		}
+	}
+	/* Events lost after the last marker */
+	if(sniff_timestamps && (sniff_lost != lost)) {
+		len += sniff_put(tx_data + len, '!', sniff_lost);
+	}
+	if(len > 0) {
+		cprint(con, (char *)tx_data, len);
+	}
+	return (msg_t)1;
+}
+
+void bbio_i2c_sniff(t_hydra_console *con, bool timestamps)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	GPIO_InitTypeDef gpio_init;
+	thread_t *thread;
+	uint8_t data;
+	uint32_t i;
+
+	if(EXTD1.state == EXT_ACTIVE) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+
+	/* Inputs only, the sniffer never drives the bus */
+	bsp_i2c_deinit(proto->dev_num);
+	gpio_init.Mode = GPIO_MODE_INPUT;
+	gpio_init.Pull = GPIO_NOPULL;
+	gpio_init.Speed = GPIO_SPEED_HIGH;
+	gpio_init.Alternate = 0; /* Not used */
+	gpio_init.Pin = SNIFF_SCL | SNIFF_SDA;
+	HAL_GPIO_Init(GPIOB, &gpio_init);
+
+	sniff_wr = 0;
+	sniff_rd = 0;
+	sniff_lost = 0;
+	sniff_timestamps = timestamps;
+	chBSemObjectInit(&sniff_sem, TRUE);
+	for(i = 0; i < EXT_MAX_CHANNELS; i++) {
+		sniff_extcfg.channels[i].mode = EXT_CH_MODE_DISABLED;
+		sniff_extcfg.channels[i].cb = NULL;
+	}
+	sniff_extcfg.channels[SNIFF_SCL_LINE].mode = EXT_CH_MODE_RISING_EDGE |
+						     EXT_CH_MODE_AUTOSTART |
+						     EXT_MODE_GPIOB;
+	sniff_extcfg.channels[SNIFF_SCL_LINE].cb = sniff_scl_cb;
+	/* Bus idle, SCL is high */
+	sniff_extcfg.channels[SNIFF_SDA_LINE].mode = EXT_CH_MODE_BOTH_EDGES |
+						     EXT_CH_MODE_AUTOSTART |
+						     EXT_MODE_GPIOB;
+	sniff_extcfg.channels[SNIFF_SDA_LINE].cb = sniff_sda_cb;
+
+	cprint(con, "\x01", 1);
+	thread = chThdCreateFromHeap(NULL, CONSOLE_WA_SIZE, "i2c_sniff",
+				     NORMALPRIO, (tfunc_t)sniff_thread, con);
+	extStart(&EXTD1, &sniff_extcfg);
+
+	/* Any byte from the host stops the sniffer */
+	while(!USER_BUTTON) {
+		if(chnReadTimeout(con->sdu, &data, 1, MS2ST(10)) == 1) {
+			break;
+		}
+	}
+
+	extStop(&EXTD1);
+	chThdTerminate(thread);
+	chThdWait(thread);
+
+	HAL_GPIO_DeInit(GPIOB, SNIFF_SCL | SNIFF_SDA);
+	bsp_i2c_init(proto->dev_num, proto);
+}
+
+/*
+ * Parameters: algorithm (0: CRC32, 1: SHA-256) and length on 4 bytes MSB
+ * first. The bytes are read with an ACK in between, the last one is left
+ * to BBIO_I2C_ACK_BIT/BBIO_I2C_NACK_BIT like BBIO_I2C_READ_BYTE.
+ * Only 0x01 and the digest are sent back, or 0x00 on error.
+ */
+static void bbio_i2c_checksum(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint8_t *rx_data = (uint8_t *)g_sbuf+4096;
+	uint8_t digest[1 + CHECKSUM_MAX_SIZE];
+	uint8_t cmd[5], size;
+	uint32_t len, i, n;
+	bsp_status_t status;
+	checksum_t ctx;
+
+	if (chnRead(con->sdu, cmd, 5) != 5) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	len = (cmd[1] << 24) + (cmd[2] << 16) + (cmd[3] << 8) + cmd[4];
+	if (cmd[0] > CHECKSUM_SHA256) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+
+	checksum_init(&ctx, cmd[0]);
+	status = BSP_OK;
+	for (i = 0, n = 0; i < len; i++) {
+		if (i > 0) {
+			bsp_i2c_read_ack(proto->dev_num, TRUE);
+		}
+		status = bsp_i2c_master_read_u8(proto->dev_num, &rx_data[n++]);
+		if (status != BSP_OK) {
+			break;
+		}
+		if (n == 4096) {
+			checksum_update(&ctx, rx_data, n);
+			n = 0;
+		}
+	}
+	checksum_update(&ctx, rx_data, n);
+	size = checksum_final(&ctx, digest + 1);
+	if (status != BSP_OK) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+
+	digest[0] = 0x01;
+	cprint(con, (char *)digest, size + 1);
 }
 
 void bbio_mode_i2c(t_hydra_console *con)
@@ -78,6 +380,9 @@ void bbio_mode_i2c(t_hydra_console *con)
 				status = bsp_i2c_master_read_u8(proto->dev_num, &data);
 				cprintf(con, "%c", data & 0xff);
 				break;
+			case BBIO_I2C_CHECKSUM:
+				bbio_i2c_checksum(con);
+				break;
 			case BBIO_I2C_ACK_BIT:
 				bsp_i2c_read_ack(proto->dev_num, TRUE);
 				cprint(con, "\x01", 1);
@@ -87,7 +392,10 @@ void bbio_mode_i2c(t_hydra_console *con)
 				cprint(con, "\x01", 1);
 				break;
 			case BBIO_I2C_START_SNIFF:
-				bbio_i2c_sniff(con);
+				bbio_i2c_sniff(con, FALSE);
+				break;
+			case BBIO_I2C_START_SNIFF_TS:
+				bbio_i2c_sniff(con, TRUE);
 				break;
 			case BBIO_I2C_WRITE_READ:
 				chnRead(con->sdu, rx_data, 4);
@@ -122,7 +430,7 @@ void bbio_mode_i2c(t_hydra_console *con)
 				if(to_rx >= 1)
 				{
 					/* Read I2C bytes with ACK */
-					for(i = 0; i < to_rx - 1; i++)
+					for(i = 1; i < to_rx; i++)
 					{
 						bsp_i2c_master_read_u8(proto->dev_num, &rx_data[i]);
 						bsp_i2c_read_ack(proto->dev_num, TRUE);
@@ -136,12 +444,9 @@ void bbio_mode_i2c(t_hydra_console *con)
 				/* Send I2C Stop */
 				bsp_i2c_stop(proto->dev_num);
 
-				i=0;
-				cprint(con, "\x01", 1);
-				while(i < to_rx) {
-					cprintf(con, "%c", rx_data[i]);
-					i++;
-				}
+				/* Status byte and payload are sent in one write */
+				rx_data[0] = 0x01;
+				cprint(con, (char *)rx_data, to_rx+1);
 				break;
 			default:
 				if ((bbio_subcommand & BBIO_I2C_BULK_WRITE) == BBIO_I2C_BULK_WRITE) {
@@ -155,14 +460,10 @@ void bbio_mode_i2c(t_hydra_console *con)
 					for(i = 0; i < data; i++)
 					{
 						bsp_i2c_master_write_u8(proto->dev_num, tx_data[i], &tx_ack_flag);
-						if(tx_ack_flag == TRUE)
-						{
-							cprintf(con, "\x00", 1); //  ACK (0x00)
-						}else
-						{
-							cprintf(con, "\x01", 1); // NACK (0x01)
-						}
+						/* ACK (0x00) or NACK (0x01) */
+						rx_data[i] = (tx_ack_flag == TRUE) ? 0x00 : 0x01;
 					}
+					cprint(con, (char *)rx_data, data);
 				} else if ((bbio_subcommand & BBIO_I2C_SET_SPEED) == BBIO_I2C_SET_SPEED) {
 					proto->dev_speed = bbio_subcommand & 0b11;
 					status = bsp_i2c_init(proto->dev_num, proto);
@@ -26,6 +26,7 @@
 
 #include "hydrabus_bbio.h"
 #include "bsp_spi.h"
+#include "hydrabus_checksum.h"
 
 void bbio_spi_init_proto_default(t_hydra_console *con)
 {
@@ -86,10 +87,394 @@ void bbio_spi_sniff(t_hydra_console *con)
 	status = bsp_spi_deinit(BSP_DEV_SPI2);
 }
 
+/*
+ * DMA sniffer, SPI1 and SPI2 are slaves clocked by the bus:
+ * - bus SCK on SPI1 SCK (PB3) and SPI2 SCK (PB10);
+ * - bus MOSI on SPI1 MOSI (PB5), bus MISO on SPI2 MOSI (PC3);
+ * - bus CS on SPI1 NSS (PA15).
+ * Both SPI are received by circular DMA into a ring in g_sbuf, the CS
+ * edges are timestamped by EXTI with the byte counts of both rings.
+ * A thread sends the bytes of each CS low period as a frame, batching the
+ * frames while USB is busy:
+ * flags, CS falling and rising edge times in CPU cycles (4 bytes each),
+ * MOSI length (2 bytes), MOSI data, MISO length (2 bytes), MISO data.
+ * All values are MSB first.
+ */
+#define SNIFF_RING_SIZE		(16384)
+#define SNIFF_MAX_DATA		(SNIFF_RING_SIZE - 16)
+#define SNIFF_NB_EVENTS		(64)
+#define SNIFF_FRAME_HDR_LEN	(13)
+/* Frames or data lost before this frame */
+#define SNIFF_FLAG_LOST		0x01
+/* Frame longer than SNIFF_MAX_DATA, data not sent */
+#define SNIFF_FLAG_TRUNCATED	0x02
+
+typedef struct {
+	uint32_t time;
+	uint32_t count[2];
+	uint8_t cs;
+} sniff_event_t;
+
+static sniff_event_t sniff_events[SNIFF_NB_EVENTS];
+static volatile uint32_t sniff_event_wr;
+static volatile uint32_t sniff_event_rd;
+static volatile bool sniff_event_lost;
+static semaphore_t sniff_sem;
+static EXTConfig sniff_extcfg;
+
+static void sniff_extcb(EXTDriver *extp, expchannel_t channel)
+{
+	sniff_event_t *event;
+	uint32_t time;
+
+	(void)extp;
+	(void)channel;
+
+	time = get_cyclecounter();
+	chSysLockFromISR();
+	if(sniff_event_wr - sniff_event_rd >= SNIFF_NB_EVENTS) {
+		sniff_event_lost = TRUE;
+	} else {
+		event = &sniff_events[sniff_event_wr % SNIFF_NB_EVENTS];
+		event->time = time;
+		event->cs = bsp_spi_get_cs(BSP_DEV_SPI1);
+		event->count[0] = bsp_spi_rx_circular_count(BSP_DEV_SPI1);
+		event->count[1] = bsp_spi_rx_circular_count(BSP_DEV_SPI2);
+		sniff_event_wr++;
+		chSemSignalI(&sniff_sem);
+	}
+	chSysUnlockFromISR();
+}
+
+static uint8_t *sniff_put(uint8_t *buf, uint32_t value, uint8_t nb_bytes)
+{
+	while(nb_bytes--) {
+		*buf++ = value >> (nb_bytes * 8);
+	}
+	return buf;
+}
+
+static uint32_t sniff_frame_len(const sniff_event_t *start,
+				const sniff_event_t *end)
+{
+	uint32_t i, n, len;
+
+	len = SNIFF_FRAME_HDR_LEN;
+	for(i = 0; i < 2; i++) {
+		n = end->count[i] - start->count[i];
+		if(n <= SNIFF_MAX_DATA) {
+			len += n;
+		}
+	}
+	return len;
+}
+
+/* Build the frame of a CS low period, return its length */
+static uint32_t sniff_frame(uint8_t *buf, const sniff_event_t *start,
+			    const sniff_event_t *end, uint8_t flags)
+{
+	const uint8_t *ring;
+	uint8_t *p;
+	uint32_t i, n, pos, count;
+
+	p = sniff_put(buf + 1, start->time, 4);
+	p = sniff_put(p, end->time, 4);
+	for(i = 0; i < 2; i++) {
+		ring = (uint8_t *)g_sbuf + (i * SNIFF_RING_SIZE);
+		n = end->count[i] - start->count[i];
+		if(n > SNIFF_MAX_DATA) {
+			flags |= SNIFF_FLAG_TRUNCATED;
+			n = 0;
+		}
+		p = sniff_put(p, n, 2);
+
+		pos = start->count[i] % SNIFF_RING_SIZE;
+		if(pos + n > SNIFF_RING_SIZE) {
+			memcpy(p, ring + pos, SNIFF_RING_SIZE - pos);
+			memcpy(p + SNIFF_RING_SIZE - pos, ring, pos + n - SNIFF_RING_SIZE);
+		} else {
+			memcpy(p, ring + pos, n);
+		}
+		p += n;
+
+		/* Overwritten by the DMA before being copied */
+		chSysLock();
+		count = bsp_spi_rx_circular_count(i == 0 ? BSP_DEV_SPI1 : BSP_DEV_SPI2);
+		chSysUnlock();
+		if(count - start->count[i] > SNIFF_RING_SIZE) {
+			flags |= SNIFF_FLAG_LOST;
+		}
+	}
+	buf[0] = flags;
+
+	return p - buf;
+}
+
+static msg_t sniff_thread(void *arg)
+{
+	t_hydra_console *con;
+	uint8_t *tx_data = (uint8_t *)g_sbuf + (2 * SNIFF_RING_SIZE);
+	sniff_event_t event, start;
+	uint32_t len;
+	uint8_t flags;
+	bool started;
+
+	con = arg;
+	chRegSetThreadName("SPI sniffer");
+	len = 0;
+	flags = 0;
+	started = FALSE;
+
+	while(!chThdShouldTerminateX() || (sniff_event_rd != sniff_event_wr)) {
+		if(sniff_event_rd == sniff_event_wr) {
+			/* Send the frames batched while USB was busy */
+			if(len > 0) {
+				cprint(con, (char *)tx_data, len);
+				len = 0;
+			}
+			chSemWaitTimeout(&sniff_sem, MS2ST(10));
+			continue;
+		}
+		event = sniff_events[sniff_event_rd % SNIFF_NB_EVENTS];
+		sniff_event_rd++;
+		if(sniff_event_lost) {
+			sniff_event_lost = FALSE;
+			flags |= SNIFF_FLAG_LOST;
+		}
+
+		if(event.cs == 0) {
+			start = event;
+			started = TRUE;
+			continue;
+		}
+		if(!started) {
+			continue;
+		}
+		started = FALSE;
+
+		if(len + sniff_frame_len(&start, &event) > 2 * SNIFF_RING_SIZE) {
+			cprint(con, (char *)tx_data, len);
+			len = 0;
+		}
+		len += sniff_frame(tx_data + len, &start, &event, flags);
+		flags = 0;
+	}
+	if(len > 0) {
+		cprint(con, (char *)tx_data, len);
+	}
+	return (msg_t)1;
+}
+
+static void bbio_spi_sniff_dma(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	thread_t *thread;
+	uint8_t data;
+	uint32_t i;
+
+	proto->dev_mode = DEV_SPI_SLAVE;
+	bsp_spi_init(BSP_DEV_SPI1, proto);
+	bsp_spi_init(BSP_DEV_SPI2, proto);
+
+	if((EXTD1.state == EXT_ACTIVE) ||
+	   (bsp_spi_rx_circular_start(BSP_DEV_SPI1, (uint8_t *)g_sbuf,
+				      SNIFF_RING_SIZE) != BSP_OK) ||
+	   (bsp_spi_rx_circular_start(BSP_DEV_SPI2, (uint8_t *)g_sbuf + SNIFF_RING_SIZE,
+				      SNIFF_RING_SIZE) != BSP_OK)) {
+		cprint(con, "\x00", 1);
+		bsp_spi_rx_circular_stop(BSP_DEV_SPI1);
+		proto->dev_mode = DEV_SPI_MASTER;
+		bsp_spi_init(BSP_DEV_SPI1, proto);
+		bsp_spi_deinit(BSP_DEV_SPI2);
+		return;
+	}
+
+	sniff_event_wr = 0;
+	sniff_event_rd = 0;
+	sniff_event_lost = FALSE;
+	chSemObjectInit(&sniff_sem, 0);
+	for(i = 0; i < EXT_MAX_CHANNELS; i++) {
+		sniff_extcfg.channels[i].mode = EXT_CH_MODE_DISABLED;
+		sniff_extcfg.channels[i].cb = NULL;
+	}
+	/* PA15 */
+	sniff_extcfg.channels[15].mode = EXT_CH_MODE_BOTH_EDGES |
+					 EXT_CH_MODE_AUTOSTART |
+					 EXT_MODE_GPIOA;
+	sniff_extcfg.channels[15].cb = sniff_extcb;
+
+	cprint(con, "\x01", 1);
+	thread = chThdCreateFromHeap(NULL, CONSOLE_WA_SIZE, "spi_sniff",
+				     NORMALPRIO, (tfunc_t)sniff_thread, con);
+	extStart(&EXTD1, &sniff_extcfg);
+
+	/* Any byte from the host stops the sniffer */
+	while(!USER_BUTTON) {
+		if(chnReadTimeout(con->sdu, &data, 1, MS2ST(10)) == 1) {
+			break;
+		}
+	}
+
+	extStop(&EXTD1);
+	chThdTerminate(thread);
+	chThdWait(thread);
+	bsp_spi_rx_circular_stop(BSP_DEV_SPI1);
+	bsp_spi_rx_circular_stop(BSP_DEV_SPI2);
+
+	proto->dev_mode = DEV_SPI_MASTER;
+	bsp_spi_init(BSP_DEV_SPI1, proto);
+	bsp_spi_deinit(BSP_DEV_SPI2);
+}
+
+#define BBIO_SPI_DUMP_CHUNK (16384)
+
+/*
+ * Read a SPI flash with a single command.
+ * Parameters: opcode, address width in bytes (0 to 4), start address and
+ * length, both on 4 bytes MSB first.
+ * The next chunk is read with DMA in one half of g_sbuf while the previous
+ * one is sent to the host from the other half.
+ * Answer: 0x01, exactly length bytes, then 0x01 or 0x00 on SPI error. After
+ * an error the missing bytes are sent as 0xFF so the host stays in sync.
+ */
+static void bbio_spi_flash_dump(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint8_t *buf[2] = {
+		(uint8_t *)g_sbuf,
+		(uint8_t *)g_sbuf + BBIO_SPI_DUMP_CHUNK
+	};
+	uint8_t cmd[10];
+	uint32_t addr, len, chunk, next;
+	uint8_t addr_width, i, cur;
+	bsp_status_t status;
+
+	if (chnRead(con->sdu, cmd, 10) != 10) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	addr_width = cmd[1];
+	addr = (cmd[2] << 24) + (cmd[3] << 16) + (cmd[4] << 8) + cmd[5];
+	len = (cmd[6] << 24) + (cmd[7] << 16) + (cmd[8] << 8) + cmd[9];
+	if (addr_width > 4) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	cprint(con, "\x01", 1);
+
+	/* Opcode followed by the address */
+	for (i = 0; i < addr_width; i++) {
+		cmd[1 + i] = addr >> ((addr_width - 1 - i) * 8);
+	}
+	bsp_spi_select(proto->dev_num);
+	bsp_spi_write_u8(proto->dev_num, cmd, 1 + addr_width);
+
+	status = BSP_OK;
+	cur = 0;
+	chunk = MIN(len, BBIO_SPI_DUMP_CHUNK);
+	if (chunk > 0) {
+		bsp_spi_read_u8_start(proto->dev_num, buf[cur], chunk);
+	}
+	while (chunk > 0) {
+		status = bsp_spi_wait(proto->dev_num);
+		if (status != BSP_OK) {
+			break;
+		}
+		len -= chunk;
+		next = MIN(len, BBIO_SPI_DUMP_CHUNK);
+		if (next > 0) {
+			bsp_spi_read_u8_start(proto->dev_num, buf[cur ^ 1], next);
+		}
+		cprint(con, (char *)buf[cur], chunk);
+		cur ^= 1;
+		chunk = next;
+	}
+	bsp_spi_unselect(proto->dev_num);
+
+	if (status != BSP_OK) {
+		memset(buf[0], 0xFF, MIN(len, BBIO_SPI_DUMP_CHUNK));
+		while (len > 0) {
+			chunk = MIN(len, BBIO_SPI_DUMP_CHUNK);
+			cprint(con, (char *)buf[0], chunk);
+			len -= chunk;
+		}
+	}
+	cprint(con, (status == BSP_OK) ? "\x01" : "\x00", 1);
+}
+
+/*
+ * Same parameters as bbio_spi_flash_dump() followed by the algorithm
+ * (0: CRC32, 1: SHA-256). Only 0x01 and the digest are sent back, or
+ * 0x00 on error.
+ */
+static void bbio_spi_flash_checksum(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint8_t *buf[2] = {
+		(uint8_t *)g_sbuf,
+		(uint8_t *)g_sbuf + BBIO_SPI_DUMP_CHUNK
+	};
+	uint8_t digest[1 + CHECKSUM_MAX_SIZE];
+	uint8_t cmd[11];
+	uint32_t addr, len, chunk, next;
+	uint8_t addr_width, i, cur, size;
+	bsp_status_t status;
+	checksum_t ctx;
+
+	if (chnRead(con->sdu, cmd, 11) != 11) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	addr_width = cmd[1];
+	addr = (cmd[2] << 24) + (cmd[3] << 16) + (cmd[4] << 8) + cmd[5];
+	len = (cmd[6] << 24) + (cmd[7] << 16) + (cmd[8] << 8) + cmd[9];
+	if (addr_width > 4 || cmd[10] > CHECKSUM_SHA256) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	checksum_init(&ctx, cmd[10]);
+
+	for (i = 0; i < addr_width; i++) {
+		cmd[1 + i] = addr >> ((addr_width - 1 - i) * 8);
+	}
+	bsp_spi_select(proto->dev_num);
+	bsp_spi_write_u8(proto->dev_num, cmd, 1 + addr_width);
+
+	status = BSP_OK;
+	cur = 0;
+	chunk = MIN(len, BBIO_SPI_DUMP_CHUNK);
+	if (chunk > 0) {
+		bsp_spi_read_u8_start(proto->dev_num, buf[cur], chunk);
+	}
+	while (chunk > 0) {
+		status = bsp_spi_wait(proto->dev_num);
+		if (status != BSP_OK) {
+			break;
+		}
+		len -= chunk;
+		next = MIN(len, BBIO_SPI_DUMP_CHUNK);
+		if (next > 0) {
+			bsp_spi_read_u8_start(proto->dev_num, buf[cur ^ 1], next);
+		}
+		checksum_update(&ctx, buf[cur], chunk);
+		cur ^= 1;
+		chunk = next;
+	}
+	bsp_spi_unselect(proto->dev_num);
+
+	size = checksum_final(&ctx, digest + 1);
+	if (status != BSP_OK) {
+		cprint(con, "\x00", 1);
+		return;
+	}
+	digest[0] = 0x01;
+	cprint(con, (char *)digest, size + 1);
+}
+
 void bbio_mode_spi(t_hydra_console *con)
 {
 	uint8_t bbio_subcommand;
-	uint16_t to_rx, to_tx, i;
+	uint16_t to_rx, to_tx;
 	uint8_t *tx_data = (uint8_t *)g_sbuf;
 	uint8_t *rx_data = (uint8_t *)g_sbuf+4096;
 	uint8_t data;
@@ -113,11 +498,20 @@ void bbio_mode_spi(t_hydra_console *con)
 				bsp_spi_unselect(proto->dev_num);
 				cprint(con, "\x01", 1);
 				break;
+			case BBIO_SPI_FLASH_DUMP:
+				bbio_spi_flash_dump(con);
+				break;
+			case BBIO_SPI_FLASH_CHECKSUM:
+				bbio_spi_flash_checksum(con);
+				break;
 			case BBIO_SPI_SNIFF_ALL:
 			case BBIO_SPI_SNIFF_CS_LOW:
 			case BBIO_SPI_SNIFF_CS_HIGH:
 				bbio_spi_sniff(con);
 				break;
+			case BBIO_SPI_SNIFF_DMA:
+				bbio_spi_sniff_dma(con);
+				break;
 			case BBIO_SPI_WRITE_READ:
 			case BBIO_SPI_WRITE_READ_NCS:
 				chnRead(con->sdu, rx_data, 4);
@@ -134,28 +528,13 @@ void bbio_mode_spi(t_hydra_console *con)
 				}
 				bsp_spi_write_u8(proto->dev_num, tx_data,
 				                 to_tx);
-				i=0;
-				while(i<to_rx) {
-					if((to_rx-i) >= 255) {
-						bsp_spi_read_u8(proto->dev_num,
-						                rx_data+i,
-						                255);
-					} else {
-						bsp_spi_read_u8(proto->dev_num,
-						                rx_data+i,
-						                to_rx-i);
-					}
-					i+=255;
-				}
+				/* Status byte and payload are sent in one write */
+				bsp_spi_read_u8(proto->dev_num, rx_data+1, to_rx);
 				if(bbio_subcommand == BBIO_SPI_WRITE_READ) {
 					bsp_spi_unselect(proto->dev_num);
 				}
-				i=0;
-				cprint(con, "\x01", 1);
-				while(i < to_rx) {
-					cprintf(con, "%c", rx_data[i]);
-					i++;
-				}
+				rx_data[0] = 0x01;
+				cprint(con, (char *)rx_data, to_rx+1);
 				break;
 			default:
 				if ((bbio_subcommand & BBIO_SPI_BULK_TRANSFER) == BBIO_SPI_BULK_TRANSFER) {
@@ -166,14 +545,10 @@ void bbio_mode_spi(t_hydra_console *con)
 					chnRead(con->sdu, tx_data, data);
 					bsp_spi_write_read_u8(proto->dev_num,
 					                      tx_data,
-					                      rx_data,
+					                      rx_data+1,
 					                      data);
-					cprint(con, "\x01", 1);
-					i=0;
-					while(i < data) {
-						cprintf(con, "%c", rx_data[i]);
-						i++;
-					}
+					rx_data[0] = 0x01;
+					cprint(con, (char *)rx_data, data+1);
 				} else if ((bbio_subcommand & BBIO_SPI_SET_SPEED) == BBIO_SPI_SET_SPEED) {
 					proto->dev_speed = bbio_subcommand & 0b111;
 					status = bsp_spi_init(proto->dev_num, proto);
@@ -27,6 +27,12 @@
 #include "hydrabus_bbio.h"
 #include "bsp_uart.h"
 
+/* Echo buffers in g_sbuf: RX ring then RX copy */
+#define ECHO_RX_RING_SIZE (32768)
+#define ECHO_RX_SIZE (4096)
+/* Bulk write buffer, after the echo buffers */
+#define BULK_TX_OFFSET (ECHO_RX_RING_SIZE + ECHO_RX_SIZE)
+
 void bbio_uart_init_proto_default(t_hydra_console *con)
 {
 	mode_config_proto_t* proto = &con->mode->proto;
@@ -43,27 +49,63 @@ msg_t uart_reader_thread (void *arg)
 	t_hydra_console *con;
 	con = arg;
 	mode_config_proto_t* proto = &con->mode->proto;
-	uint8_t rx_data;
+	uint8_t *rx_data = (uint8_t *)g_sbuf + ECHO_RX_RING_SIZE;
+	uint32_t len;
 
 	chRegSetThreadName("UART reader");
 	chThdSleepMilliseconds(10);
 
-	while (!USER_BUTTON) {
-		if(bsp_uart_rxne(proto->dev_num)) {
-			bsp_uart_read_u8(proto->dev_num, &rx_data, 1);
-			cprint(con, (char *)&rx_data, 1);
-		} else {
-			chThdYield();
+	while (!USER_BUTTON && !chThdShouldTerminateX()) {
+		len = bsp_uart_rx_dma_read(proto->dev_num, rx_data,
+					   ECHO_RX_SIZE, MS2ST(10));
+		if(len > 0) {
+			cprint(con, (char *)rx_data, len);
 		}
 	}
 	chThdExit((msg_t)1);
 	return (msg_t)1;
 }
 
+/*
+ * Arbitrary baud rate, 4 bytes MSB first.
+ * Answer 0x01 followed by the final baud rate (4 bytes MSB first) or 0x00,
+ * the previous speed is kept on error.
+ */
+static void bbio_uart_baud_rate(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint8_t buf[5];
+	uint32_t baud, prev_speed;
+
+	chnRead(con->sdu, buf, 4);
+	baud = (buf[0] << 24) + (buf[1] << 16) + (buf[2] << 8) + buf[3];
+
+	prev_speed = proto->dev_speed;
+	proto->dev_speed = baud;
+	baud = 0;
+	if(bsp_uart_init(proto->dev_num, proto) == BSP_OK) {
+		/* 0 when the rate is above the UART clock */
+		baud = bsp_uart_get_final_baudrate(proto->dev_num);
+	}
+	if(baud == 0) {
+		proto->dev_speed = prev_speed;
+		bsp_uart_init(proto->dev_num, proto);
+		cprint(con, "\x00", 1);
+		return;
+	}
+
+	buf[0] = 1;
+	buf[1] = baud >> 24;
+	buf[2] = baud >> 16;
+	buf[3] = baud >> 8;
+	buf[4] = baud;
+	cprint(con, (char *)buf, 5);
+}
+
 void bbio_mode_uart(t_hydra_console *con)
 {
-	uint8_t bbio_subcommand, i;
-	uint8_t tx_data;
+	uint8_t bbio_subcommand;
+	uint8_t *tx_data = (uint8_t *)g_sbuf + BULK_TX_OFFSET;
 	uint8_t data;
 	bsp_status_t status;
 	mode_config_proto_t* proto = &con->mode->proto;
@@ -76,9 +118,20 @@ void bbio_mode_uart(t_hydra_console *con)
 		if(chnRead(con->sdu, &bbio_subcommand, 1) == 1) {
 			switch(bbio_subcommand) {
 			case BBIO_RESET:
+				if(rthread != NULL) {
+					chThdTerminate(rthread);
+					chThdWait(rthread);
+				}
 				bsp_uart_deinit(proto->dev_num);
 				return;
 			case BBIO_UART_START_ECHO:
+				if(rthread != NULL) {
+					cprint(con, "\x01", 1);
+					break;
+				}
+				bsp_uart_rx_dma_start(proto->dev_num,
+						      (uint8_t *)g_sbuf,
+						      ECHO_RX_RING_SIZE);
 				rthread = chThdCreateFromHeap(NULL,
 							      CONSOLE_WA_SIZE,
 							      "uart_reader",
@@ -94,28 +147,28 @@ void bbio_mode_uart(t_hydra_console *con)
 					chThdWait(rthread);
 					rthread = NULL;
 				}
+				bsp_uart_rx_dma_stop(proto->dev_num);
 				cprint(con, "\x01", 1);
 				break;
 			case BBIO_UART_BAUD_RATE:
-				/* Not implemented */
-				cprint(con, "\x00", 1);
+				bbio_uart_baud_rate(con);
 				break;
 			default:
 				if ((bbio_subcommand & BBIO_UART_BULK_TRANSFER) == BBIO_UART_BULK_TRANSFER) {
 					// data contains the number of bytes to
-					// write
+					// write, sent in one burst with one ack
 					data = (bbio_subcommand & 0b1111) + 1;
 
-					i=0;
-					while(i < data) {
-						chnRead(con->sdu,
-								       &tx_data,
-								       1);
-						bsp_uart_write_u8(proto->dev_num,
-								  &tx_data,
-								  1);
+					chnRead(con->sdu, tx_data, data);
+					status = bsp_uart_write_dma(proto->dev_num,
+								    tx_data, data);
+					if(status == BSP_OK) {
+						status = bsp_uart_write_dma_wait(proto->dev_num);
+					}
+					if(status == BSP_OK) {
 						cprint(con, "\x01", 1);
-						i++;
+					} else {
+						cprint(con, "\x00", 1);
 					}
 				} else if ((bbio_subcommand & BBIO_UART_SET_SPEED) == BBIO_UART_SET_SPEED) {
 					switch(bbio_subcommand & 0b1111) {
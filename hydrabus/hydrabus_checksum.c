@@ -0,0 +1,218 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+#include "bsp_crc.h"
+#include "hydrabus_checksum.h"
+#include <string.h>
+
+static const uint32_t crc32_nibble[16] = {
+	0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+	0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+	0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+	0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_init[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		w[i] = ((uint32_t)block[i * 4] << 24) | (block[i * 4 + 1] << 16) |
+		       (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+	}
+	for (i = 16; i < 64; i++) {
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+static void sha256_update(checksum_t *ctx, const uint8_t *data, uint32_t len)
+{
+	uint32_t used, n;
+
+	used = ctx->len & 63;
+	ctx->len += len;
+	if (used > 0) {
+		n = MIN(len, 64 - used);
+		memcpy(ctx->block + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_block(ctx->state, ctx->block);
+	}
+	while (len >= 64) {
+		sha256_block(ctx->state, data);
+		data += 64;
+		len -= 64;
+	}
+	memcpy(ctx->block, data, len);
+}
+
+static void sha256_final(checksum_t *ctx, uint8_t *digest)
+{
+	uint8_t pad[72];
+	uint64_t bits;
+	uint32_t used, n;
+	int i;
+
+	bits = ctx->len * 8;
+	used = ctx->len & 63;
+	n = (used < 56) ? 56 - used : 120 - used;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for (i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - i * 8);
+	sha256_update(ctx, pad, n + 8);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+}
+
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		crc = crc32_nibble[(crc ^ data[i]) & 0x0f] ^ (crc >> 4);
+		crc = crc32_nibble[(crc ^ (data[i] >> 4)) & 0x0f] ^ (crc >> 4);
+	}
+
+	return crc;
+}
+
+void checksum_init(checksum_t *ctx, checksum_algo_t algo)
+{
+	ctx->algo = algo;
+	ctx->len = 0;
+	if (algo == CHECKSUM_CRC32) {
+		ctx->crc = 0xffffffff;
+		ctx->crc_sw = FALSE;
+		bsp_crc_init();
+	} else {
+		memcpy(ctx->state, sha256_init, sizeof(sha256_init));
+	}
+}
+
+void checksum_update(checksum_t *ctx, const uint8_t *data, uint32_t len)
+{
+	if (ctx->algo == CHECKSUM_SHA256) {
+		sha256_update(ctx, data, len);
+		return;
+	}
+
+	if (!ctx->crc_sw) {
+		ctx->crc = bsp_crc_update(data, len / 4);
+		data += len & ~3;
+		len &= 3;
+		/* The CRC unit can not be loaded with a new value */
+		ctx->crc_sw = (len > 0);
+	}
+	ctx->crc = checksum_crc32(ctx->crc, data, len);
+}
+
+uint8_t checksum_final(checksum_t *ctx, uint8_t *digest)
+{
+	uint32_t crc;
+
+	if (ctx->algo == CHECKSUM_SHA256) {
+		sha256_final(ctx, digest);
+		return 32;
+	}
+
+	bsp_crc_deinit();
+	crc = ~ctx->crc;
+	digest[0] = crc >> 24;
+	digest[1] = crc >> 16;
+	digest[2] = crc >> 8;
+	digest[3] = crc;
+
+	return 4;
+}
+
+void print_checksum(t_hydra_console *con, checksum_algo_t algo,
+		    const uint8_t *digest, uint8_t size)
+{
+	uint8_t i;
+
+	cprintf(con, "%s: ", (algo == CHECKSUM_CRC32) ? "CRC32" : "SHA256");
+	for (i = 0; i < size; i++)
+		cprintf(con, "%02x", digest[i]);
+	cprintf(con, "\r\n");
+}
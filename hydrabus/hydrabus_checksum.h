@@ -0,0 +1,61 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYDRABUS_CHECKSUM_H_
+#define _HYDRABUS_CHECKSUM_H_
+
+#include "common.h"
+
+typedef enum {
+	CHECKSUM_CRC32 = 0,
+	CHECKSUM_SHA256,
+} checksum_algo_t;
+
+#define CHECKSUM_MAX_SIZE	32
+
+typedef struct {
+	checksum_algo_t algo;
+	/* CRC32 register, once data is no longer fed to the CRC unit */
+	uint32_t crc;
+	bool crc_sw;
+	/* SHA-256 */
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t block[64];
+} checksum_t;
+
+/*
+ * The CRC32 is the zlib one, computed with the CRC unit. Data must be
+ * given in multiples of 4 bytes except for the last chunk, otherwise
+ * it continues in software.
+ */
+void checksum_init(checksum_t *ctx, checksum_algo_t algo);
+void checksum_update(checksum_t *ctx, const uint8_t *data, uint32_t len);
+/* Return the digest size, the CRC32 digest is MSB first */
+uint8_t checksum_final(checksum_t *ctx, uint8_t *digest);
+
+/*
+ * Software CRC32 for data not aligned for the CRC unit or fed while it
+ * is in use. Start from 0xffffffff and invert the result.
+ */
+uint32_t checksum_crc32(uint32_t crc, const uint8_t *data, uint32_t len);
+
+void print_checksum(t_hydra_console *con, checksum_algo_t algo,
+		    const uint8_t *digest, uint8_t size);
+
+#endif /* _HYDRABUS_CHECKSUM_H_ */
@@ -19,12 +19,15 @@
 
 #include "hydrabus_mode_i2c.h"
 #include "bsp_i2c.h"
+#include "hydrabus_checksum.h"
 #include <string.h>
 
 static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos);
 static int show(t_hydra_console *con, t_tokenline_parsed *p);
 static void scan(t_hydra_console *con, t_tokenline_parsed *p);
 static uint32_t dump(t_hydra_console *con, uint8_t *rx_data, uint8_t nb_data);
+static uint32_t checksum(t_hydra_console *con, checksum_algo_t algo,
+			 uint32_t nb_data);
 
 #define I2C_DEV_NUM (1)
 
@@ -105,6 +108,7 @@ static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
 	float arg_float;
 	int arg_int, t, i;
 	bsp_status_t bsp_status;
+	checksum_algo_t algo;
 
 	for (t = token_pos; p->tokens[t]; t++) {
 		switch (p->tokens[t]) {
@@ -161,6 +165,19 @@ static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
 			}
 			dump(con, proto->buffer_rx, arg_int);
 			break;
+		case T_CRC32:
+		case T_SHA256:
+			algo = (p->tokens[t] == T_CRC32) ?
+			       CHECKSUM_CRC32 : CHECKSUM_SHA256;
+			/* Integer parameter. */
+			if (p->tokens[t + 1] == T_ARG_TOKEN_SUFFIX_INT) {
+				t += 2;
+				memcpy(&arg_int, p->buf + p->tokens[t], sizeof(int));
+			} else {
+				arg_int = 1;
+			}
+			checksum(con, algo, arg_int);
+			break;
 		default:
 			return t - token_pos;
 		}
@@ -288,6 +305,43 @@ static uint32_t dump(t_hydra_console *con, uint8_t *rx_data, uint8_t nb_data)
 	return status;
 }
 
+/* Same as dump() but only the checksum of the bytes is printed */
+static uint32_t checksum(t_hydra_console *con, checksum_algo_t algo,
+			 uint32_t nb_data)
+{
+	uint8_t buf[64], digest[CHECKSUM_MAX_SIZE], size;
+	uint32_t i, n, status;
+	mode_config_proto_t* proto = &con->mode->proto;
+	checksum_t ctx;
+
+	checksum_init(&ctx, algo);
+	status = BSP_OK;
+	for(i = 0, n = 0; i < nb_data; i++) {
+		if(proto->ack_pending) {
+			/* Send I2C ACK */
+			bsp_i2c_read_ack(I2C_DEV_NUM, TRUE);
+		}
+
+		status = bsp_i2c_master_read_u8(proto->dev_num, &buf[n++]);
+		if(status != BSP_OK)
+			break;
+
+		proto->ack_pending = 1;
+		if(n == sizeof(buf)) {
+			checksum_update(&ctx, buf, n);
+			n = 0;
+		}
+	}
+	checksum_update(&ctx, buf, n);
+	size = checksum_final(&ctx, digest);
+	if(status != BSP_OK) {
+		cprintf(con, "I2C read error %d.\r\n", status);
+		return status;
+	}
+	print_checksum(con, algo, digest, size);
+	return status;
+}
+
 static void cleanup(t_hydra_console *con)
 {
 	mode_config_proto_t* proto = &con->mode->proto;
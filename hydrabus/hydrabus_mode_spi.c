@@ -18,6 +18,7 @@
  */
 
 #include "hydrabus_mode_spi.h"
+#include "hydrabus_spi_flash.h"
 #include "bsp_spi.h"
 #include "hydranfc.h"
 #include "common.h"
@@ -255,6 +256,12 @@ static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
 			}
 			dump(con, proto->buffer_rx, arg_int);
 			break;
+		case T_FLASH:
+			t += spi_flash_exec(con, p, t + 1);
+			break;
+		case T_EMUL_FLASH:
+			t += spi_flash_emul_exec(con, p, t + 1);
+			break;
 		default:
 			return t - token_pos;
 		}
@@ -19,10 +19,17 @@
 #include "common.h"
 #include "hydrabus_mode_uart.h"
 #include "bsp_uart.h"
+#include "hydrabus_uart_autobaud.h"
+#include "hydrabus_uart_sniff.h"
 #include <string.h>
 
 #define UART_DEFAULT_SPEED (9600)
 
+/* Bridge buffers in g_sbuf: RX ring, RX copy, two TX buffers */
+#define BRIDGE_RX_RING_SIZE (32768)
+#define BRIDGE_RX_SIZE (4096)
+#define BRIDGE_TX_SIZE (1024)
+
 static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos);
 static int show(t_hydra_console *con, t_tokenline_parsed *p);
 static uint32_t dump(t_hydra_console *con, uint8_t *rx_data, uint8_t nb_data);
@@ -90,15 +97,15 @@ msg_t bridge_thread (void *arg)
 	con = arg;
 	chRegSetThreadName("UART reader");
 	chThdSleepMilliseconds(10);
-	uint8_t rx_data;
+	uint8_t *rx_data = (uint8_t *)g_sbuf + BRIDGE_RX_RING_SIZE;
+	uint32_t len;
 	mode_config_proto_t* proto = &con->mode->proto;
 
-	while (!USER_BUTTON) {
-		if(bsp_uart_rxne(proto->dev_num)) {
-			bsp_uart_read_u8(proto->dev_num, &rx_data , 1);
-			cprint(con, (char *)&rx_data, 1);
-		} else {
-			chThdYield();
+	while (!USER_BUTTON && !chThdShouldTerminateX()) {
+		len = bsp_uart_rx_dma_read(proto->dev_num, rx_data,
+					   BRIDGE_RX_SIZE, MS2ST(10));
+		if(len > 0) {
+			cprint(con, (char *)rx_data, len);
 		}
 	}
 	return (msg_t)1;
@@ -106,21 +113,38 @@ msg_t bridge_thread (void *arg)
 
 static void bridge(t_hydra_console *con)
 {
-	uint8_t tx_data;
+	uint8_t *tx_data[2];
+	uint32_t len, i;
 	mode_config_proto_t* proto = &con->mode->proto;
 
+	tx_data[0] = (uint8_t *)g_sbuf + BRIDGE_RX_RING_SIZE + BRIDGE_RX_SIZE;
+	tx_data[1] = tx_data[0] + BRIDGE_TX_SIZE;
+
 	cprintf(con, "Interrupt by pressing user button.\r\n");
 	cprint(con, "\r\n", 2);
 
+	/* Without DMA stream the reader polls the UART */
+	bsp_uart_rx_dma_start(proto->dev_num, (uint8_t *)g_sbuf,
+			      BRIDGE_RX_RING_SIZE);
+
 	thread_t *bthread = chThdCreateFromHeap(NULL, CONSOLE_WA_SIZE, "bridge_thread",
 						LOWPRIO, (tfunc_t)bridge_thread, con);
+	i = 0;
 	while(!USER_BUTTON) {
-		if(chnRead(con->sdu, &tx_data, 1) == 1) {
-			bsp_uart_write_u8(proto->dev_num, &tx_data, 1);
+		len = chnReadTimeout(con->sdu, tx_data[i], 1, MS2ST(10));
+		if(len == 0) {
+			continue;
 		}
+		/* Send everything already received from USB at once */
+		len += chnReadTimeout(con->sdu, tx_data[i] + 1,
+				      BRIDGE_TX_SIZE - 1, TIME_IMMEDIATE);
+		bsp_uart_write_dma(proto->dev_num, tx_data[i], len);
+		i ^= 1;
 	}
+	bsp_uart_write_dma_wait(proto->dev_num);
 	chThdTerminate(bthread);
 	chThdWait(bthread);
+	bsp_uart_rx_dma_stop(proto->dev_num);
 }
 
 static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
@@ -224,6 +248,12 @@ static int exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
 		case T_BRIDGE:
 			bridge(con);
 			break;
+		case T_AUTOBAUD:
+			uart_autobaud(con);
+			break;
+		case T_SNIFF:
+			t += uart_sniff_exec(con, p, t + 1);
+			break;
 		case T_HD:
 			/* Integer parameter. */
 			if (p->tokens[t + 1] == T_ARG_TOKEN_SUFFIX_INT) {
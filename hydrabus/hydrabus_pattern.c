@@ -0,0 +1,410 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2015 Nicolas OBERLI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+#include "tokenline.h"
+#include "ff.h"
+#include "microsd.h"
+#include "hydrabus_sump.h"
+#include "stm32f4xx_hal.h"
+#include <stdio.h> /* snprintf */
+#include <string.h>
+
+/*
+ * Samples are played by DMA writes to the BSRR registers, on the same
+ * TIM8 events as the SUMP capture: TIM8_UP (DMA2 Stream1 Channel7) for
+ * GPIOC and TIM8_CH3 compare (DMA2 Stream4 Channel7) for GPIOB.
+ * DMA1 cannot access AHB1 GPIO registers.
+ * BSRR words are built in small circular buffers, each half being
+ * refilled from the samples when the DMA has played it.
+ */
+#define PATTERN_TIM_CLOCK	168000000
+#define PATTERN_MAX_RATE	5000000
+#define PATTERN_MIN_TICKS	(PATTERN_TIM_CLOCK / PATTERN_MAX_RATE)
+#define PATTERN_HALF_LEN	256
+
+#define PATTERN_DMA_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 1))
+#define PATTERN_DMA_PORTB_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 4))
+#define PATTERN_DMA_CHANNEL	7
+#define PATTERN_DMA_IRQ_PRIORITY	6
+
+/*
+ * PC0-7 and PC13-14, PC8-12 are the SDIO bus and PC15 is not sampled.
+ * PB0-11, PB12-15 are used by the USB HS port.
+ */
+#define PATTERN_PORTC_MASK	0x60ff
+#define PATTERN_PORTB_MASK	0x0fff
+
+#define PATTERN_UPLOAD_TIMEOUT	MS2ST(1000)
+
+static TIM_HandleTypeDef htim;
+static uint32_t bsrr_portc[2 * PATTERN_HALF_LEN];
+static uint32_t bsrr_portb[2 * PATTERN_HALF_LEN];
+static semaphore_t pattern_sem;
+
+static uint32_t (*pattern_get)(uint32_t n);
+static uint32_t pattern_len;
+static uint32_t pattern_pos;
+static uint32_t pattern_last;
+static bool pattern_wide;
+static bool pattern_loop;
+/* Halves played by the DMA, and needed to play the samples once */
+static uint32_t pattern_played;
+static uint32_t pattern_halves;
+/* Halves played again before being refilled */
+static uint32_t pattern_underruns;
+
+static uint32_t get_sample16(uint32_t n)
+{
+	return ((uint16_t *)g_sbuf)[n];
+}
+
+static uint32_t get_sample32(uint32_t n)
+{
+	return ((uint32_t *)g_sbuf)[n];
+}
+
+static inline uint32_t bsrr(uint32_t value, uint32_t mask)
+{
+	return (value & mask) | ((~value & mask) << 16);
+}
+
+static void pattern_fill(uint32_t half)
+{
+	uint32_t *portc, *portb;
+	uint32_t i, sample;
+
+	portc = bsrr_portc + (half * PATTERN_HALF_LEN);
+	portb = bsrr_portb + (half * PATTERN_HALF_LEN);
+	for(i = 0; i < PATTERN_HALF_LEN; i++) {
+		if((pattern_pos == pattern_len) && pattern_loop) {
+			pattern_pos = 0;
+		}
+		/* Hold the last value once all samples are played */
+		if(pattern_pos < pattern_len) {
+			pattern_last = pattern_get(pattern_pos++);
+		}
+		sample = pattern_last;
+		portc[i] = bsrr(sample, PATTERN_PORTC_MASK);
+		if(pattern_wide) {
+			portb[i] = bsrr(sample >> 16, PATTERN_PORTB_MASK);
+		}
+	}
+}
+
+static void pattern_dma_isr(void *p, uint32_t flags)
+{
+	(void)p;
+	uint32_t half;
+
+	for(half = 0; half < 2; half++) {
+		if(!(flags & (half ? STM32_DMA_ISR_TCIF : STM32_DMA_ISR_HTIF))) {
+			continue;
+		}
+		if(flags & (half ? STM32_DMA_ISR_HTIF : STM32_DMA_ISR_TCIF)) {
+			pattern_underruns++;
+		}
+		pattern_played++;
+		pattern_fill(half);
+		if(!pattern_loop && (pattern_played == pattern_halves)) {
+			/* All samples played, the last value is held until stop */
+			chSysLockFromISR();
+			chSemSignalI(&pattern_sem);
+			chSysUnlockFromISR();
+		}
+	}
+}
+
+static void pattern_gpio_init(GPIO_TypeDef *port, uint32_t mask,
+			      uint32_t value)
+{
+	GPIO_InitTypeDef gpio_init;
+
+	/* Start from the first sample */
+	port->BSRRL = value & mask;
+	port->BSRRH = ~value & mask;
+
+	gpio_init.Pin = mask;
+	gpio_init.Mode = GPIO_MODE_OUTPUT_PP;
+	gpio_init.Speed = GPIO_SPEED_HIGH;
+	gpio_init.Pull = GPIO_NOPULL;
+	gpio_init.Alternate = 0; /* Not used */
+	HAL_GPIO_Init(port, &gpio_init);
+}
+
+/* Return the number of timer ticks between two samples */
+static uint32_t pattern_tim_init(uint32_t frequency)
+{
+	uint32_t ticks, prescaler;
+
+	ticks = PATTERN_TIM_CLOCK / frequency;
+	if(ticks < PATTERN_MIN_TICKS) {
+		ticks = PATTERN_MIN_TICKS;
+	}
+	prescaler = (ticks >> 16) + 1;
+
+	htim.Instance = TIM8;
+	htim.Init.Prescaler = prescaler - 1;
+	htim.Init.Period = (ticks / prescaler) - 1;
+	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim.Init.RepetitionCounter = 0;
+
+	HAL_TIM_Base_MspInit(&htim);
+	__TIM8_CLK_ENABLE();
+	HAL_TIM_Base_Init(&htim);
+
+	return (ticks / prescaler) * prescaler;
+}
+
+static bool dma_init(const stm32_dma_stream_t *stream, uint32_t *buf,
+		     volatile void *reg)
+{
+	if(dmaStreamAllocate(stream, PATTERN_DMA_IRQ_PRIORITY,
+			     (stream == PATTERN_DMA_STREAM) ? pattern_dma_isr : NULL,
+			     NULL)) {
+		return FALSE;
+	}
+	dmaStreamSetPeripheral(stream, reg);
+	dmaStreamSetMemory0(stream, buf);
+	dmaStreamSetTransactionSize(stream, 2 * PATTERN_HALF_LEN);
+	dmaStreamSetMode(stream, STM32_DMA_CR_CHSEL(PATTERN_DMA_CHANNEL) |
+			 STM32_DMA_CR_PL(3) | STM32_DMA_CR_DIR_M2P |
+			 STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD |
+			 STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC |
+			 ((stream == PATTERN_DMA_STREAM) ?
+			  (STM32_DMA_CR_HTIE | STM32_DMA_CR_TCIE) : 0));
+	dmaStreamClearInterrupt(stream);
+	dmaStreamEnable(stream);
+	return TRUE;
+}
+
+static void pattern_play(t_hydra_console *con, uint32_t frequency)
+{
+	uint32_t ticks, first;
+
+	if(pattern_len == 0) {
+		cprintf(con, "No samples to play.\r\n");
+		return;
+	}
+
+	first = pattern_get(0);
+	pattern_pos = 0;
+	pattern_last = first;
+	pattern_played = 0;
+	pattern_halves = (pattern_len + PATTERN_HALF_LEN - 1) / PATTERN_HALF_LEN;
+	pattern_underruns = 0;
+	pattern_fill(0);
+	pattern_fill(1);
+	chSemObjectInit(&pattern_sem, 0);
+
+	/* The GPIOC stream interrupt refills both buffers */
+	if(!dma_init(PATTERN_DMA_STREAM, bsrr_portc, &GPIOC->BSRRL)) {
+		cprintf(con, "DMA stream already in use.\r\n");
+		return;
+	}
+	if(pattern_wide &&
+	   !dma_init(PATTERN_DMA_PORTB_STREAM, bsrr_portb, &GPIOB->BSRRL)) {
+		dmaStreamDisable(PATTERN_DMA_STREAM);
+		dmaStreamRelease(PATTERN_DMA_STREAM);
+		cprintf(con, "DMA stream already in use.\r\n");
+		return;
+	}
+
+	ticks = pattern_tim_init(frequency);
+	pattern_gpio_init(GPIOC, PATTERN_PORTC_MASK, first);
+	if(pattern_wide) {
+		pattern_gpio_init(GPIOB, PATTERN_PORTB_MASK, first >> 16);
+		/* Match on the last tick of each period, before the update */
+		__HAL_TIM_SET_COMPARE(&htim, TIM_CHANNEL_3, htim.Init.Period);
+		__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_CC3);
+	}
+
+	cprintf(con, "Playing %d samples at %d Hz%s, interrupt by pressing user button.\r\n",
+		pattern_len, PATTERN_TIM_CLOCK / ticks,
+		pattern_loop ? " continuously" : "");
+
+	__HAL_TIM_SET_COUNTER(&htim, 0);
+	__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_UPDATE);
+	HAL_TIM_Base_Start(&htim);
+
+	while(!USER_BUTTON) {
+		if(chSemWaitTimeout(&pattern_sem, MS2ST(10)) == MSG_OK) {
+			break;
+		}
+	}
+
+	HAL_TIM_Base_Stop(&htim);
+	__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_UPDATE | TIM_DMA_CC3);
+	dmaStreamDisable(PATTERN_DMA_STREAM);
+	dmaStreamRelease(PATTERN_DMA_STREAM);
+	if(pattern_wide) {
+		dmaStreamDisable(PATTERN_DMA_PORTB_STREAM);
+		dmaStreamRelease(PATTERN_DMA_PORTB_STREAM);
+	}
+	HAL_TIM_Base_DeInit(&htim);
+	__TIM8_CLK_DISABLE();
+
+	HAL_GPIO_DeInit(GPIOC, PATTERN_PORTC_MASK);
+	if(pattern_wide) {
+		HAL_GPIO_DeInit(GPIOB, PATTERN_PORTB_MASK);
+	}
+
+	if(pattern_underruns > 0) {
+		cprintf(con, "%d buffer underruns, rate too high.\r\n",
+			pattern_underruns);
+	}
+}
+
+/* Load raw little endian samples from the microSD in g_sbuf */
+static bool pattern_load_file(t_hydra_console *con, const char *filename,
+			      uint32_t width)
+{
+	char path[FILENAME_SIZE + 4];
+	FRESULT err;
+	FIL fp;
+	UINT cnt;
+
+	if (!is_fs_ready() && (err = mount())) {
+		cprintf(con, "Mount failed: error %d.\r\n", err);
+		return FALSE;
+	}
+
+	snprintf(path, FILENAME_SIZE, "0:%s", filename);
+	err = f_open(&fp, path, FA_READ | FA_OPEN_EXISTING);
+	if (err != FR_OK) {
+		cprintf(con, "Failed to open file %s: error %d.\r\n", path, err);
+		return FALSE;
+	}
+	if(fp.fsize > NB_SBUFFER) {
+		cprintf(con, "Only the first %d bytes are played.\r\n", NB_SBUFFER);
+	}
+
+	err = f_read(&fp, g_sbuf, MIN(fp.fsize, NB_SBUFFER), &cnt);
+	f_close(&fp);
+	if (err != FR_OK) {
+		cprintf(con, "Failed to read file: error %d.\r\n", err);
+		return FALSE;
+	}
+	pattern_len = cnt / width;
+	return TRUE;
+}
+
+/* Read raw little endian samples sent by the host in g_sbuf */
+static bool pattern_upload(t_hydra_console *con, uint32_t samples,
+			   uint32_t width)
+{
+	uint32_t len, cnt, n;
+
+	len = samples * width;
+	if(len > NB_SBUFFER) {
+		cprintf(con, "Too many samples, max %d.\r\n", NB_SBUFFER / width);
+		return FALSE;
+	}
+
+	cprintf(con, "Send %d bytes.\r\n", len);
+	cnt = 0;
+	while(cnt < len) {
+		n = chnReadTimeout(con->sdu, g_sbuf + cnt, len - cnt,
+				   PATTERN_UPLOAD_TIMEOUT);
+		cnt += n;
+		if((n == 0) || USER_BUTTON) {
+			break;
+		}
+	}
+	if(cnt < len) {
+		cprintf(con, "Received %d of %d bytes, nothing played.\r\n",
+			cnt, len);
+		return FALSE;
+	}
+	pattern_len = cnt / width;
+	return TRUE;
+}
+
+int cmd_pattern(t_hydra_console *con, t_tokenline_parsed *p)
+{
+	uint32_t frequency = 100000;
+	uint32_t samples = 0;
+	uint32_t width;
+	char *filename = NULL;
+	bool sump = FALSE;
+	bool upload = FALSE;
+	int str_offset;
+	int t;
+
+	pattern_wide = FALSE;
+	pattern_loop = FALSE;
+
+	t = 1;
+	while (p->tokens[t]) {
+		switch (p->tokens[t++]) {
+		case T_FILE:
+			t += 1;
+			memcpy(&str_offset, &p->tokens[t++], sizeof(int));
+			filename = p->buf + str_offset;
+			break;
+		case T_SUMP:
+			sump = TRUE;
+			break;
+		case T_UPLOAD:
+			t += 1;
+			memcpy(&samples, p->buf + p->tokens[t++], sizeof(uint32_t));
+			upload = TRUE;
+			break;
+		case T_WIDE:
+			pattern_wide = TRUE;
+			break;
+		case T_FREQUENCY:
+			t += 1;
+			memcpy(&frequency, p->buf + p->tokens[t++], sizeof(uint32_t));
+			break;
+		case T_CONTINUOUS:
+			pattern_loop = TRUE;
+			break;
+		}
+	}
+
+	if(frequency == 0) {
+		cprintf(con, "Invalid frequency.\r\n");
+		return FALSE;
+	}
+
+	if(sump) {
+		pattern_len = sump_capture_len(&width);
+		pattern_wide = (width == 4);
+		pattern_get = sump_capture_sample;
+	} else {
+		width = pattern_wide ? 4 : 2;
+		pattern_get = pattern_wide ? get_sample32 : get_sample16;
+		if(filename != NULL) {
+			if(!pattern_load_file(con, filename, width)) {
+				return FALSE;
+			}
+		} else if(upload) {
+			if(!pattern_upload(con, samples, width)) {
+				return FALSE;
+			}
+		} else {
+			cprintf(con, "Please specify file, upload or sump.\r\n");
+			return FALSE;
+		}
+	}
+
+	pattern_play(con, frequency);
+	return TRUE;
+}
@@ -0,0 +1,806 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+#include "tokenline.h"
+#include "ff.h"
+#include "microsd.h"
+#include "bsp_spi.h"
+#include "hydrabus_spi_flash.h"
+#include "hydrabus_checksum.h"
+#include <stdio.h> /* snprintf */
+#include <string.h>
+
+/* SPI NOR flash opcodes, 4 bytes address variants for parts above 16MB */
+#define FLASH_CMD_WREN		0x06
+#define FLASH_CMD_RDSR		0x05
+#define FLASH_CMD_RDID		0x9F
+#define FLASH_CMD_RDSFDP	0x5A
+#define FLASH_CMD_READ		0x03
+#define FLASH_CMD_FAST_READ	0x0B
+#define FLASH_CMD_FAST_READ4	0x0C
+#define FLASH_CMD_PP		0x02
+#define FLASH_CMD_PP4		0x12
+#define FLASH_CMD_SE		0x20
+#define FLASH_CMD_SE4		0x21
+#define FLASH_CMD_BE		0xD8
+#define FLASH_CMD_BE4		0xDC
+
+#define FLASH_SR_WIP		0x01
+#define FLASH_SR_WEL		0x02
+
+#define FLASH_PAGE_SIZE		256
+#define FLASH_SECTOR_SIZE	4096
+#define FLASH_BLOCK_SIZE	65536
+#define FLASH_3B_MAX_SIZE	0x1000000
+
+/* WIP timeouts in ms */
+#define FLASH_PP_TIMEOUT	10
+#define FLASH_ERASE_TIMEOUT	5000
+
+/* Image and flash data chunks, each one uses a quarter of g_sbuf */
+#define FLASH_CHUNK_SIZE	16384
+/* Data kept in the first and last erased sectors, in the last quarters */
+#define FLASH_HEAD_BUF		((uint8_t *)g_sbuf + (2 * FLASH_CHUNK_SIZE))
+#define FLASH_TAIL_BUF		((uint8_t *)g_sbuf + (3 * FLASH_CHUNK_SIZE))
+
+/* Emulation runs on SPI1, the fastest one, the image is held in g_sbuf */
+#define EMUL_DEV		BSP_DEV_SPI1
+#define EMUL_SPI		SPI1
+#define EMUL_CS_HIGH()		(GPIOA->IDR & GPIO_PIN_15) /* SPI1 NSS */
+#define EMUL_MIN_SIZE		4096
+/* No paging from the card, a read command needs its data within a byte */
+#define EMUL_MAX_SIZE		NB_SBUFFER
+/* Winbond W25Q series, the capacity byte comes from the image size */
+#define EMUL_DEFAULT_ID		0xEF4000
+
+typedef struct {
+	uint8_t id[3];
+	uint32_t size;
+	uint8_t addr_width;
+	/* 4KB erase opcode */
+	uint8_t se_cmd;
+	bool sfdp;
+} spi_flash_t;
+
+static FIL file;
+static char path[FILENAME_SIZE + 4];
+static spi_flash_t flash;
+
+/* Opcode followed by the address, MSB first */
+static uint8_t flash_header(uint8_t *hdr, uint8_t cmd, uint32_t addr,
+			    uint8_t addr_width)
+{
+	uint8_t i;
+
+	hdr[0] = cmd;
+	for (i = 0; i < addr_width; i++)
+		hdr[1 + i] = addr >> ((addr_width - 1 - i) * 8);
+
+	return 1 + addr_width;
+}
+
+static void flash_cmd(bsp_dev_spi_t dev, uint8_t *hdr, uint8_t hdr_len,
+		      uint8_t *rx_data, uint32_t nb_data)
+{
+	bsp_spi_select(dev);
+	bsp_spi_write_u8(dev, hdr, hdr_len);
+	if (nb_data > 0)
+		bsp_spi_read_u8(dev, rx_data, nb_data);
+	bsp_spi_unselect(dev);
+}
+
+static uint8_t flash_status(bsp_dev_spi_t dev)
+{
+	uint8_t cmd, status;
+
+	cmd = FLASH_CMD_RDSR;
+	flash_cmd(dev, &cmd, 1, &status, 1);
+
+	return status;
+}
+
+static bool flash_write_enable(bsp_dev_spi_t dev)
+{
+	uint8_t cmd;
+
+	cmd = FLASH_CMD_WREN;
+	flash_cmd(dev, &cmd, 1, NULL, 0);
+
+	return (flash_status(dev) & FLASH_SR_WEL) != 0;
+}
+
+/* Poll WIP, erase operations give the CPU back between polls */
+static bool flash_wait(bsp_dev_spi_t dev, uint32_t timeout_ms, bool sleep)
+{
+	systime_t start, end;
+
+	start = chVTGetSystemTime();
+	end = start + MS2ST(timeout_ms);
+	while (flash_status(dev) & FLASH_SR_WIP) {
+		if (USER_BUTTON || !chVTIsSystemTimeWithin(start, end))
+			return FALSE;
+		if (sleep)
+			chThdSleepMilliseconds(1);
+	}
+	return TRUE;
+}
+
+static void flash_read_sfdp(bsp_dev_spi_t dev, uint32_t addr, uint8_t *buf,
+			    uint32_t len)
+{
+	uint8_t hdr[5];
+
+	flash_header(hdr, FLASH_CMD_RDSFDP, addr, 3);
+	/* Dummy byte */
+	hdr[4] = 0;
+	flash_cmd(dev, hdr, 5, buf, len);
+}
+
+static uint32_t get_u32_le(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24);
+}
+
+/*
+ * Size and 4KB erase opcode come from the SFDP basic parameter table,
+ * or from the JEDEC ID capacity byte for older parts.
+ */
+static bool flash_detect(t_hydra_console *con, bsp_dev_spi_t dev)
+{
+	uint8_t cmd, buf[16];
+	uint32_t ptp, param, density;
+
+	cmd = FLASH_CMD_RDID;
+	flash_cmd(dev, &cmd, 1, flash.id, 3);
+	if ((flash.id[0] == 0x00 && flash.id[1] == 0x00 && flash.id[2] == 0x00) ||
+	    (flash.id[0] == 0xFF && flash.id[1] == 0xFF && flash.id[2] == 0xFF)) {
+		cprintf(con, "No SPI flash detected.\r\n");
+		return FALSE;
+	}
+
+	flash.size = 0;
+	flash.sfdp = FALSE;
+	flash.se_cmd = FLASH_CMD_SE;
+
+	flash_read_sfdp(dev, 0, buf, 16);
+	/* Signature, then the first parameter header (JEDEC basic table) */
+	if (!memcmp(buf, "SFDP", 4) && buf[11] >= 2) {
+		ptp = buf[12] | (buf[13] << 8) | (buf[14] << 16);
+		flash_read_sfdp(dev, ptp, buf, 8);
+
+		param = get_u32_le(buf);
+		if ((param & 0x03) == 0x01)
+			flash.se_cmd = (param >> 8) & 0xFF;
+
+		density = get_u32_le(buf + 4);
+		if (density & 0x80000000) {
+			density &= 0x7FFFFFFF;
+			if (density >= 3 && density < 35)
+				flash.size = 1 << (density - 3);
+		} else {
+			flash.size = (density >> 3) + 1;
+		}
+		flash.sfdp = (flash.size > 0);
+	}
+	if (flash.size == 0 && flash.id[2] >= 0x10 && flash.id[2] <= 0x1F)
+		flash.size = 1 << flash.id[2];
+
+	cprintf(con, "JEDEC ID: %02X %02X %02X\r\n",
+		flash.id[0], flash.id[1], flash.id[2]);
+	if (flash.size == 0) {
+		cprintf(con, "Unknown flash size.\r\n");
+		return FALSE;
+	}
+	flash.addr_width = (flash.size > FLASH_3B_MAX_SIZE) ? 4 : 3;
+	cprintf(con, "Size: %d KB (%s), %d bytes address\r\n",
+		flash.size / 1024, flash.sfdp ? "SFDP" : "JEDEC ID",
+		flash.addr_width);
+
+	return TRUE;
+}
+
+static void print_progress(t_hydra_console *con, const char *action,
+			   uint32_t done, uint32_t total)
+{
+	cprintf(con, "\r%s: %d%%", action,
+		(uint32_t)(((uint64_t)done * 100) / total));
+}
+
+static void print_rate(t_hydra_console *con, uint32_t size, systime_t start)
+{
+	uint32_t ms, rate;
+
+	ms = ST2MS(chVTGetSystemTime() - start);
+	if (ms == 0)
+		ms = 1;
+	/* MB/s with 2 decimals */
+	rate = ((uint64_t)size * 100) / ((uint64_t)ms * 1000);
+	cprintf(con, " %d.%03ds %d.%02d MB/s\r\n", ms / 1000, ms % 1000,
+		rate / 100, rate % 100);
+}
+
+/* Bytes between the end of the image and the end of its last sector */
+static uint32_t flash_tail(uint32_t end)
+{
+	return (FLASH_SECTOR_SIZE - (end & (FLASH_SECTOR_SIZE - 1))) &
+	       (FLASH_SECTOR_SIZE - 1);
+}
+
+static void flash_read(bsp_dev_spi_t dev, uint32_t addr, uint8_t *buf,
+		       uint32_t len)
+{
+	uint8_t hdr[6], hdr_len;
+
+	if (len == 0)
+		return;
+	hdr_len = flash_header(hdr, (flash.addr_width == 4) ?
+			       FLASH_CMD_FAST_READ4 : FLASH_CMD_FAST_READ,
+			       addr, flash.addr_width);
+	/* Dummy byte */
+	hdr[hdr_len++] = 0;
+	flash_cmd(dev, hdr, hdr_len, buf, len);
+}
+
+static bool flash_erase(t_hydra_console *con, bsp_dev_spi_t dev,
+			uint32_t addr, uint32_t size)
+{
+	uint8_t hdr[5], hdr_len, cmd;
+	uint32_t start, end, step;
+	systime_t ticks;
+
+	ticks = chVTGetSystemTime();
+	start = addr & ~(FLASH_SECTOR_SIZE - 1);
+	end = addr + size;
+
+	/* Data sharing a sector with the image, see flash_restore() */
+	flash_read(dev, start, FLASH_HEAD_BUF, addr - start);
+	flash_read(dev, end, FLASH_TAIL_BUF, flash_tail(end));
+
+	addr = start;
+	while (addr < end) {
+		if (!(addr & (FLASH_BLOCK_SIZE - 1)) && (end - addr) >= FLASH_BLOCK_SIZE) {
+			cmd = (flash.addr_width == 4) ? FLASH_CMD_BE4 : FLASH_CMD_BE;
+			step = FLASH_BLOCK_SIZE;
+		} else {
+			cmd = (flash.addr_width == 4) ? FLASH_CMD_SE4 : flash.se_cmd;
+			step = FLASH_SECTOR_SIZE;
+		}
+		if (!flash_write_enable(dev)) {
+			cprintf(con, "\r\nWrite enable failed, flash write protected?\r\n");
+			return FALSE;
+		}
+		hdr_len = flash_header(hdr, cmd, addr, flash.addr_width);
+		flash_cmd(dev, hdr, hdr_len, NULL, 0);
+		if (!flash_wait(dev, FLASH_ERASE_TIMEOUT, TRUE)) {
+			cprintf(con, "\r\nErase failed at 0x%08X.\r\n", addr);
+			return FALSE;
+		}
+		addr += step;
+		print_progress(con, "Erase", addr - start, end - start);
+	}
+	print_rate(con, addr - start, ticks);
+
+	return TRUE;
+}
+
+/* Page program cannot cross a page boundary */
+static bool flash_write(t_hydra_console *con, bsp_dev_spi_t dev,
+			uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+	uint8_t hdr[5], hdr_len;
+	uint32_t i, n;
+
+	for (i = 0; i < len; i += n) {
+		n = FLASH_PAGE_SIZE - ((addr + i) & (FLASH_PAGE_SIZE - 1));
+		n = MIN(n, len - i);
+
+		if (!flash_write_enable(dev)) {
+			cprintf(con, "\r\nWrite enable failed, flash write protected?\r\n");
+			return FALSE;
+		}
+		hdr_len = flash_header(hdr,
+				       (flash.addr_width == 4) ? FLASH_CMD_PP4 : FLASH_CMD_PP,
+				       addr + i, flash.addr_width);
+		bsp_spi_select(dev);
+		bsp_spi_write_u8(dev, hdr, hdr_len);
+		bsp_spi_write_u8(dev, (uint8_t *)buf + i, n);
+		bsp_spi_unselect(dev);
+		if (!flash_wait(dev, FLASH_PP_TIMEOUT, FALSE)) {
+			cprintf(con, "\r\nProgram failed at 0x%08X.\r\n", addr + i);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static bool flash_program(t_hydra_console *con, bsp_dev_spi_t dev,
+			  uint32_t addr, uint32_t size)
+{
+	uint8_t *buf = (uint8_t *)g_sbuf;
+	uint32_t done, len;
+	systime_t ticks;
+	FRESULT err;
+	UINT bytes_read;
+
+	ticks = chVTGetSystemTime();
+	f_lseek(&file, 0);
+	for (done = 0; done < size; done += len) {
+		len = MIN(size - done, FLASH_CHUNK_SIZE);
+		err = f_read(&file, buf, len, &bytes_read);
+		if (err != FR_OK || bytes_read != len) {
+			cprintf(con, "\r\nFailed to read file: error %d.\r\n", err);
+			return FALSE;
+		}
+		if (!flash_write(con, dev, addr + done, buf, len))
+			return FALSE;
+		print_progress(con, "Program", done + len, size);
+	}
+	print_rate(con, size, ticks);
+
+	return TRUE;
+}
+
+/* Program back the data of the first and last sectors around the image */
+static bool flash_restore(t_hydra_console *con, bsp_dev_spi_t dev,
+			  uint32_t addr, uint32_t size)
+{
+	uint32_t start, end;
+
+	start = addr & ~(FLASH_SECTOR_SIZE - 1);
+	end = addr + size;
+	if (!flash_write(con, dev, start, FLASH_HEAD_BUF, addr - start))
+		return FALSE;
+	return flash_write(con, dev, end, FLASH_TAIL_BUF, flash_tail(end));
+}
+
+/*
+ * The flash is read with DMA in one buffer while the next image chunk is
+ * read from the microSD card in the other one.
+ */
+static bool flash_verify(t_hydra_console *con, bsp_dev_spi_t dev,
+			 uint32_t addr, uint32_t size)
+{
+	uint8_t *file_buf = (uint8_t *)g_sbuf;
+	uint8_t *flash_buf = (uint8_t *)g_sbuf + FLASH_CHUNK_SIZE;
+	uint8_t hdr[6], hdr_len;
+	uint32_t done, len, i;
+	systime_t ticks;
+	bsp_status_t status;
+	FRESULT err;
+	UINT bytes_read;
+	bool ret;
+
+	ticks = chVTGetSystemTime();
+	f_lseek(&file, 0);
+	hdr_len = flash_header(hdr, (flash.addr_width == 4) ?
+			       FLASH_CMD_FAST_READ4 : FLASH_CMD_FAST_READ,
+			       addr, flash.addr_width);
+	/* Dummy byte */
+	hdr[hdr_len++] = 0;
+
+	ret = TRUE;
+	bsp_spi_select(dev);
+	bsp_spi_write_u8(dev, hdr, hdr_len);
+	for (done = 0; done < size; done += len) {
+		len = MIN(size - done, FLASH_CHUNK_SIZE);
+		bsp_spi_read_u8_start(dev, flash_buf, len);
+		err = f_read(&file, file_buf, len, &bytes_read);
+		status = bsp_spi_wait(dev);
+		if (err != FR_OK || bytes_read != len) {
+			cprintf(con, "\r\nFailed to read file: error %d.\r\n", err);
+			ret = FALSE;
+			break;
+		}
+		if (status != BSP_OK) {
+			cprintf(con, "\r\nSPI read error %d.\r\n", status);
+			ret = FALSE;
+			break;
+		}
+		if (memcmp(file_buf, flash_buf, len)) {
+			for (i = 0; file_buf[i] == flash_buf[i]; i++);
+			cprintf(con, "\r\nMismatch at 0x%08X: flash 0x%02X, file 0x%02X.\r\n",
+				addr + done + i, flash_buf[i], file_buf[i]);
+			ret = FALSE;
+			break;
+		}
+		print_progress(con, "Verify", done + len, size);
+	}
+	bsp_spi_unselect(dev);
+	if (ret)
+		print_rate(con, size, ticks);
+
+	return ret;
+}
+
+/*
+ * Fast read with DMA in one half of g_sbuf while the other half is given
+ * to the checksum.
+ */
+static bool flash_checksum(t_hydra_console *con, bsp_dev_spi_t dev,
+			   uint32_t addr, uint32_t size, checksum_algo_t algo)
+{
+	uint8_t *buf[2] = { (uint8_t *)g_sbuf,
+			    (uint8_t *)g_sbuf + FLASH_CHUNK_SIZE };
+	uint8_t digest[CHECKSUM_MAX_SIZE];
+	uint8_t hdr[6], hdr_len, i;
+	uint32_t done, len, next;
+	systime_t ticks;
+	bsp_status_t status;
+	checksum_t ctx;
+
+	ticks = chVTGetSystemTime();
+	checksum_init(&ctx, algo);
+	hdr_len = flash_header(hdr, (flash.addr_width == 4) ?
+			       FLASH_CMD_FAST_READ4 : FLASH_CMD_FAST_READ,
+			       addr, flash.addr_width);
+	/* Dummy byte */
+	hdr[hdr_len++] = 0;
+
+	status = BSP_OK;
+	next = 0;
+	bsp_spi_select(dev);
+	bsp_spi_write_u8(dev, hdr, hdr_len);
+	len = MIN(size, FLASH_CHUNK_SIZE);
+	bsp_spi_read_u8_start(dev, buf[0], len);
+	for (done = 0, i = 0; done < size; done += len, len = next, i ^= 1) {
+		status = bsp_spi_wait(dev);
+		if (status != BSP_OK) {
+			cprintf(con, "\r\nSPI read error %d.\r\n", status);
+			break;
+		}
+		next = MIN(size - done - len, FLASH_CHUNK_SIZE);
+		if (next > 0)
+			bsp_spi_read_u8_start(dev, buf[i ^ 1], next);
+		checksum_update(&ctx, buf[i], len);
+		print_progress(con, "Read", done + len, size);
+	}
+	bsp_spi_unselect(dev);
+	len = checksum_final(&ctx, digest);
+	if (status != BSP_OK)
+		return FALSE;
+
+	print_rate(con, size, ticks);
+	print_checksum(con, algo, digest, len);
+
+	return TRUE;
+}
+
+static bool flash_open(t_hydra_console *con, const char *filename)
+{
+	int err;
+
+	if (!is_fs_ready() && (err = mount())) {
+		cprintf(con, "Mount failed: error %d.\r\n", err);
+		return FALSE;
+	}
+
+	snprintf(path, FILENAME_SIZE, "0:%s", filename);
+	err = f_open(&file, path, FA_READ);
+	if (err != FR_OK) {
+		cprintf(con, "Failed to open file %s: error %d.\r\n", path, err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+int spi_flash_exec(t_hydra_console *con, t_tokenline_parsed *p, int token_pos)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	bsp_dev_spi_t dev;
+	const char *filename;
+	uint32_t addr, size;
+	int action, str_offset, t;
+	checksum_algo_t algo;
+	bool done, ret;
+
+	action = 0;
+	filename = NULL;
+	addr = 0;
+	size = 0;
+	done = FALSE;
+	for (t = token_pos; !done && p->tokens[t]; t++) {
+		switch (p->tokens[t]) {
+		case T_ID:
+		case T_WRITE:
+		case T_VERIFY:
+		case T_CRC32:
+		case T_SHA256:
+			action = p->tokens[t];
+			break;
+		case T_FILE:
+			t += 2;
+			memcpy(&str_offset, &p->tokens[t], sizeof(int));
+			filename = p->buf + str_offset;
+			break;
+		case T_ADDRESS:
+			t += 2;
+			memcpy(&addr, p->buf + p->tokens[t], sizeof(uint32_t));
+			break;
+		case T_LENGTH:
+			t += 2;
+			memcpy(&size, p->buf + p->tokens[t], sizeof(uint32_t));
+			break;
+		default:
+			done = TRUE;
+			t--;
+			break;
+		}
+	}
+
+	if (action == 0) {
+		cprintf(con, "Please specify id, write, verify, crc32 or sha256.\r\n");
+		return t - token_pos;
+	}
+	if (proto->dev_mode != DEV_SPI_MASTER) {
+		cprintf(con, "SPI must be in master mode.\r\n");
+		return t - token_pos;
+	}
+	dev = proto->dev_num;
+
+	if (!flash_detect(con, dev) || action == T_ID)
+		return t - token_pos;
+
+	if (action == T_CRC32 || action == T_SHA256) {
+		if (size == 0 && addr < flash.size)
+			size = flash.size - addr;
+		if (size == 0 || addr >= flash.size || size > flash.size - addr) {
+			cprintf(con, "Invalid range.\r\n");
+			return t - token_pos;
+		}
+		algo = (action == T_CRC32) ? CHECKSUM_CRC32 : CHECKSUM_SHA256;
+		cprintf(con, "Checksum of %d bytes at 0x%08X\r\n", size, addr);
+		flash_checksum(con, dev, addr, size, algo);
+		return t - token_pos;
+	}
+
+	if (filename == NULL) {
+		cprintf(con, "Please specify the image filename.\r\n");
+		return t - token_pos;
+	}
+	if (!flash_open(con, filename))
+		return t - token_pos;
+
+	size = file.fsize;
+	if (size == 0 || addr >= flash.size || size > flash.size - addr) {
+		cprintf(con, "Image of %d bytes does not fit at 0x%08X.\r\n",
+			size, addr);
+		f_close(&file);
+		return t - token_pos;
+	}
+	cprintf(con, "Image: %s, %d bytes at 0x%08X\r\n", path, size, addr);
+
+	ret = TRUE;
+	if (action == T_WRITE) {
+		ret = flash_erase(con, dev, addr, size) &&
+		      flash_program(con, dev, addr, size) &&
+		      flash_restore(con, dev, addr, size);
+	}
+	if (ret)
+		ret = flash_verify(con, dev, addr, size);
+	cprintf(con, ret ? "Done.\r\n" : "Failed.\r\n");
+
+	f_close(&file);
+
+	return t - token_pos;
+}
+
+/* Next byte from the master, FALSE once CS is high */
+static inline bool emul_rx(SPI_TypeDef *spi, uint8_t *data)
+{
+	while (!(spi->SR & SPI_SR_RXNE)) {
+		if (EMUL_CS_HIGH() || USER_BUTTON)
+			return FALSE;
+	}
+	*data = spi->DR;
+	return TRUE;
+}
+
+static inline bool emul_tx(SPI_TypeDef *spi, uint8_t data)
+{
+	while (!(spi->SR & SPI_SR_TXE)) {
+		if (EMUL_CS_HIGH() || USER_BUTTON)
+			return FALSE;
+	}
+	spi->DR = data;
+	return TRUE;
+}
+
+/* Next bytes of an answer, by DMA or by the CPU without DMA stream */
+static void emul_tx_start(SPI_TypeDef *spi, const uint8_t *data,
+			  uint32_t size, uint32_t pos)
+{
+	if (bsp_spi_slave_tx_start(EMUL_DEV, data, size, pos) == BSP_OK)
+		return;
+
+	while (emul_tx(spi, data[pos]))
+		pos = (pos + 1 < size) ? pos + 1 : 0;
+}
+
+/*
+ * A byte written to DR goes out with the next byte clocked by the master.
+ * The first byte of the answer is written by the CPU as soon as the
+ * command or the address is received, then the DMA feeds MISO, looping
+ * over the ID, the status or the whole image like a real part.
+ * READ, RDID and RDSR leave half a clock to write the first byte, so they
+ * only work at slow clocks or with a gap between bytes. FAST_READ writes
+ * it during the dummy byte and works at tens of MHz.
+ * Returns with the DMA running, the caller waits for CS high.
+ */
+static uint8_t flash_emul_cmd(SPI_TypeDef *spi, const uint8_t *image,
+			      uint32_t mask, const uint8_t *id)
+{
+	static const uint8_t status = 0x00;
+	uint32_t addr, start, byte_time, i;
+	uint8_t cmd, data;
+
+	if (!emul_rx(spi, &cmd))
+		return 0;
+
+	switch (cmd) {
+	case FLASH_CMD_RDID:
+		spi->DR = id[0];
+		emul_tx_start(spi, id, 3, 1);
+		break;
+	case FLASH_CMD_RDSR:
+		spi->DR = status;
+		emul_tx_start(spi, &status, 1, 0);
+		break;
+	case FLASH_CMD_READ:
+	case FLASH_CMD_FAST_READ:
+		addr = 0;
+		start = 0;
+		byte_time = 0;
+		for (i = 0; i < 3; i++) {
+			if (!emul_rx(spi, &data))
+				return cmd;
+			byte_time = get_cyclecounter() - start;
+			start = get_cyclecounter();
+			addr = (addr << 8) | data;
+		}
+		/* Make sure the dummy byte has started, it may not at slow clocks */
+		if (cmd == FLASH_CMD_FAST_READ) {
+			while (get_cyclecounter() - start < byte_time / 4);
+		}
+		addr &= mask;
+		spi->DR = image[addr];
+		emul_tx_start(spi, image, mask + 1, (addr + 1) & mask);
+		break;
+	}
+	return cmd;
+}
+
+static void flash_emul(t_hydra_console *con, const uint8_t *image,
+		       uint32_t mask, const uint8_t *id)
+{
+	uint32_t nb_cmd, nb_read;
+	uint8_t cmd;
+
+	nb_cmd = 0;
+	nb_read = 0;
+	bsp_spi_slave_reset(EMUL_DEV, 0xFF);
+	while (!USER_BUTTON) {
+		if (EMUL_CS_HIGH())
+			continue;
+
+		/*
+		 * Nothing may delay the command and address phase, the
+		 * interrupts are served again once the DMA feeds MISO.
+		 */
+		chSysLock();
+		cmd = flash_emul_cmd(EMUL_SPI, image, mask, id);
+		chSysUnlock();
+
+		while (!EMUL_CS_HIGH() && !USER_BUTTON);
+		chSysLock();
+		bsp_spi_slave_reset(EMUL_DEV, 0xFF);
+		chSysUnlock();
+
+		nb_cmd++;
+		if (cmd == FLASH_CMD_READ || cmd == FLASH_CMD_FAST_READ)
+			nb_read++;
+	}
+	cprintf(con, "%d commands, %d reads.\r\n", nb_cmd, nb_read);
+}
+
+int spi_flash_emul_exec(t_hydra_console *con, t_tokenline_parsed *p,
+			int token_pos)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint8_t *image = (uint8_t *)g_sbuf;
+	const char *filename;
+	uint32_t size, jedec_id, i;
+	uint8_t id[3];
+	long dev_mode;
+	int str_offset, t;
+	FRESULT err;
+	UINT bytes_read;
+	bool done;
+
+	filename = NULL;
+	jedec_id = 0;
+	done = FALSE;
+	for (t = token_pos; !done && p->tokens[t]; t++) {
+		switch (p->tokens[t]) {
+		case T_FILE:
+			t += 2;
+			memcpy(&str_offset, &p->tokens[t], sizeof(int));
+			filename = p->buf + str_offset;
+			break;
+		case T_ID:
+			t += 2;
+			memcpy(&jedec_id, p->buf + p->tokens[t], sizeof(uint32_t));
+			break;
+		default:
+			done = TRUE;
+			t--;
+			break;
+		}
+	}
+
+	if (proto->dev_num != EMUL_DEV) {
+		cprintf(con, "Flash emulation needs SPI1.\r\n");
+		return t - token_pos;
+	}
+
+	/* Erased flash by default */
+	memset(image, 0xFF, EMUL_MAX_SIZE);
+	size = EMUL_MIN_SIZE;
+	if (filename != NULL) {
+		if (!flash_open(con, filename))
+			return t - token_pos;
+		if (file.fsize > EMUL_MAX_SIZE) {
+			cprintf(con, "Image truncated to %d bytes.\r\n",
+				EMUL_MAX_SIZE);
+		}
+		err = f_read(&file, image, EMUL_MAX_SIZE, &bytes_read);
+		f_close(&file);
+		if (err != FR_OK) {
+			cprintf(con, "Failed to read file: error %d.\r\n", err);
+			return t - token_pos;
+		}
+		while (size < bytes_read)
+			size <<= 1;
+	}
+
+	if (jedec_id == 0) {
+		/* Capacity byte is log2 of the size */
+		jedec_id = EMUL_DEFAULT_ID;
+		for (i = size; i > 1; i >>= 1)
+			jedec_id++;
+	}
+	id[0] = jedec_id >> 16;
+	id[1] = jedec_id >> 8;
+	id[2] = jedec_id;
+
+	dev_mode = proto->dev_mode;
+	proto->dev_mode = DEV_SPI_SLAVE;
+	bsp_spi_init(EMUL_DEV, proto);
+
+	cprintf(con, "Emulating a %d KB flash, ID %02X %02X %02X.\r\n",
+		size / 1024, id[0], id[1], id[2]);
+	cprintf(con, "Press user button to stop.\r\n");
+	flash_emul(con, image, size - 1, id);
+
+	proto->dev_mode = dev_mode;
+	bsp_spi_init(EMUL_DEV, proto);
+
+	return t - token_pos;
+}
@@ -19,18 +19,189 @@
 
 #include "common.h"
 #include "tokenline.h"
+#include "microsd.h"
 #include "hydrabus_sump.h"
+#include "hydrabus_sump_trigger.h"
+#include "hydrabus_sump_file.h"
 #include "stm32f4xx_hal.h"
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
-#define STATES_LEN 8192
+/*
+ * Samples are transferred by DMA in chunks of SUMP_CHUNK_SIZE bytes, the
+ * DMA double buffer pointers being moved along the sample ring at each
+ * transfer complete interrupt.
+ * The guard area lets the DMA run past the stop point without overwriting
+ * the oldest samples sent back to the client.
+ * The sample ring uses the whole g_sbuf: CCM RAM cannot be accessed by
+ * the DMA.
+ * When channel groups 2 or 3 are enabled, GPIOC and GPIOB are sampled by
+ * two DMA streams into the two halves of the ring, a 32 bits sample
+ * being rebuilt from both halves, each half keeping a two chunks guard.
+ */
+#define SUMP_CHUNK_SIZE	1024
+#define SUMP_GUARD_SIZE	(4 * SUMP_CHUNK_SIZE)
+#define SUMP_RING_SIZE	(sizeof(g_sbuf) - (sizeof(g_sbuf) % SUMP_CHUNK_SIZE))
+#define SUMP_NB_CHUNKS	(SUMP_RING_SIZE / SUMP_CHUNK_SIZE)
+/* Chunks being written by the DMA double buffer */
+#define SUMP_GUARD_CHUNKS	2
+/* Sample memory reported to the client, in bytes */
+#define STATES_SIZE	(SUMP_RING_SIZE - SUMP_GUARD_SIZE)
+
+/* TIM8 is clocked from APB2 timer clock */
+#define SUMP_TIM_CLOCK	168000000
+#define SUMP_MAX_SAMPLE_RATE	20000000
+#define SUMP_MIN_TICKS	(SUMP_TIM_CLOCK / SUMP_MAX_SAMPLE_RATE)
+/* Both DMA streams share DMA2 and the AHB1 bus in 32 channels mode */
+#define SUMP_WIDE_MAX_SAMPLE_RATE	10000000
+#define SUMP_WIDE_MIN_TICKS	(SUMP_TIM_CLOCK / SUMP_WIDE_MAX_SAMPLE_RATE)
+
+/*
+ * TIM8_UP request is on DMA2 Stream1 Channel7.
+ * DMA1 cannot access AHB1 GPIO registers, so TIM4 cannot be used here.
+ * With an external clock, samples are taken on TIM8_CH1 (PC6) input
+ * captures, TIM8_CH1 request is on DMA2 Stream2 Channel7.
+ */
+#define SUMP_DMA_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 1))
+#define SUMP_DMA_EXT_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 2))
+/*
+ * GPIOB is sampled on TIM8_CH3 compare, one tick before the update event.
+ * TIM8_CH3 request is on DMA2 Stream4 Channel7, shared with ADC1 which
+ * cannot run at the same time. Stream3 (TIM8_CH2) is used by SDIO.
+ */
+#define SUMP_DMA_PORTB_STREAM	STM32_DMA_STREAM(STM32_DMA_STREAM_ID(2, 4))
+#define SUMP_DMA_CHANNEL	7
+#define SUMP_DMA_IRQ_PRIORITY	6
+#define SUMP_EXT_CLOCK_PIN	GPIO_PIN_6
+
+/* PB12-15 are used by the USB HS port, channels 28-31 always read 0 */
+#define SUMP_PORTB_PINS	12
+#define SUMP_PORTB_MASK	((1 << SUMP_PORTB_PINS) - 1)
+
+/* Size of the staging buffer used to send samples to the client */
+#define SUMP_TX_LEN	512
+
+/*
+ * In RLE mode the DMA only uses the first chunks of the buffer, samples
+ * are compressed from there to the rest of the buffer.
+ */
+#define SUMP_RLE_RAW_CHUNKS	8
+#define SUMP_RLE_SIZE	(SUMP_RING_SIZE - (SUMP_RLE_RAW_CHUNKS * SUMP_CHUNK_SIZE))
+
+/*
+ * In timestamp mode each transition is stored as the new port value and
+ * the DWT cycle counter, which wraps after 2^32 cycles (25s @168MHz).
+ */
+typedef struct {
+	uint32_t time;
+	uint32_t value;
+} sump_ts_record;
+
+#define SUMP_TS_RECORDS	(SUMP_RING_SIZE / sizeof(sump_ts_record))
+#define SUMP_TS_MAX_WINDOW	(0x7fffffff)
+/* Rate of the samples rebuilt from the transitions */
+#define SUMP_TS_MAX_SAMPLE_RATE	100000000
+
+/*
+ * A single edge or level trigger on PC0-14 is armed as an EXTI interrupt,
+ * the trigger scan then only looks at the samples around the interrupt.
+ * The window covers the worst EXTI latency, with critical sections and
+ * interrupts of the same priority, at the current sample rate.
+ */
+#define SUMP_HW_TRIGGER_LATENCY_US	20
+
+/* Sample rates offered by the OLS profile */
+static const uint32_t sump_rates[] = {
+	20000000, 10000000, 5000000, 4000000, 2000000, 1000000, 500000,
+	200000, 100000, 50000, 20000, 10000, 5000, 2000, 1000, 500, 200,
+	100, 50, 20, 10
+};
 
-static uint16_t *buffer = (uint16_t *)g_sbuf;
-static uint16_t INDEX = 0;
+static uint8_t *buffer = g_sbuf;
+static uint8_t *portb_buffer = g_sbuf + (SUMP_RING_SIZE / 2);
+/* Samples sent back to the client, raw or RLE encoded */
+static uint8_t *sample_buf;
+static uint32_t INDEX = 0;
 static TIM_HandleTypeDef htim;
 static sump_config config;
+static sump_trigger trigger_seq;
+/* Sample width seen by the trigger, 2 when GPIOB is not involved */
+static uint32_t trigger_width;
+/* GPIOC and GPIOB halves of a chunk merged for the trigger */
+static uint32_t trigger_merge[SUMP_CHUNK_SIZE / sizeof(uint16_t)];
+
+/*
+ * Samples are stored on 8 bits when a single channel group is enabled,
+ * 16 bits when only GPIOC groups are enabled, 32 bits otherwise.
+ * Lengths below are in samples.
+ */
+static uint32_t sample_width;
+static uint32_t sample_shift;
+static uint32_t chunk_len;
+static uint32_t ring_len;
+static uint32_t states_len;
+/* Number of timer ticks between two samples */
+static uint32_t sample_ticks;
+/* Samples taken on an external clock edge instead of the timer */
+static bool external_clock;
+static const stm32_dma_stream_t *dma_stream;
+static const stm32_dma_stream_t *dma_portb_stream;
+/* Signaled each time a chunk has been filled by the DMA */
+static semaphore_t dma_sem;
+static volatile uint32_t dma_chunks;
+static uint32_t dma_next_chunk;
+static uint32_t dma_portb_next_chunk;
+static uint32_t dma_nb_chunks;
+/* RLE encoder state */
+static bool rle_mode;
+static uint32_t rle_index;
+static uint32_t rle_items;
+static uint32_t rle_value;
+static uint32_t rle_count;
+static uint32_t rle_flag;
+/* Chunks dropped because the trigger scan, RLE or USB was too slow */
+static uint32_t overruns;
+static uint32_t stream_chunks;
+/* Timestamp mode state */
+static bool timestamp_mode;
+static sump_ts_record *ts_records = (sump_ts_record *)g_sbuf;
+static EXTConfig ts_extcfg;
+static volatile uint32_t ts_count;
+static volatile uint8_t ts_state;
+static uint32_t ts_mask;
+static uint32_t ts_trigger_time;
+static uint32_t ts_end_time;
+/* Sample period in CPU cycles / 100 */
+static uint32_t ts_period;
+static uint32_t ts_index;
+/* EXTI trigger state */
+static EXTConfig hw_trigger_extcfg;
+static semaphore_t hw_trigger_sem;
+static volatile uint32_t hw_trigger_pos;
+/* Last raw capture, kept for sump_capture_sample() */
+static uint32_t capture_start;
+static uint32_t capture_len;
+/* Duration of the last upload in CPU cycles */
+static uint32_t upload_cycles;
+static uint32_t upload_bytes;
+
+static void portb_init(void)
+{
+	GPIO_InitTypeDef gpio_init;
+	uint8_t gpio_pin;
+
+	gpio_init.Mode = GPIO_MODE_INPUT;
+	gpio_init.Speed = GPIO_SPEED_HIGH;
+	gpio_init.Pull = GPIO_PULLDOWN;
+	gpio_init.Alternate = 0; /* Not used */
+
+	for(gpio_pin = 0; gpio_pin < SUMP_PORTB_PINS; gpio_pin++) {
+		HAL_GPIO_DeInit(GPIOB, 1 << gpio_pin);
+		gpio_init.Pin = 1 << gpio_pin;
+		HAL_GPIO_Init(GPIOB, &gpio_init);
+	}
+}
 
 static void portc_init(void)
 {
@@ -52,91 +223,928 @@ static void portc_init(void)
 	}
 }
 
-static void tim_init(void)
+/* Closest number of timer ticks the timer can actually count */
+static uint32_t sump_ticks(uint32_t ticks)
 {
-	htim.Instance = TIM4;
+	uint32_t prescaler;
 
-	htim.Init.Period = 21 - 1;
-	htim.Init.Prescaler = 2*(config.divider) - 1;
-	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
-	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	if(ticks < SUMP_MIN_TICKS) {
+		ticks = SUMP_MIN_TICKS;
+	}
+	prescaler = (ticks >> 16) + 1;
+	return ((ticks + (prescaler / 2)) / prescaler) * prescaler;
+}
 
-	HAL_TIM_Base_MspInit(&htim);
-	__TIM4_CLK_ENABLE();
+/* SUMP divider is relative to a 100MHz clock */
+static uint32_t sump_divider_ticks(uint32_t divider)
+{
+	return sump_ticks(((uint64_t)(divider + 1) * (SUMP_TIM_CLOCK / 1000000) + 50) / 100);
+}
+
+static void tim_set_ticks(uint32_t ticks)
+{
+	uint32_t prescaler;
+
+	sample_ticks = sump_ticks(ticks);
+	prescaler = (sample_ticks >> 16) + 1;
+
+	HAL_TIM_Base_DeInit(&htim);
+	htim.Init.Prescaler = prescaler - 1;
+	htim.Init.Period = (sample_ticks / prescaler) - 1;
 	HAL_TIM_Base_Init(&htim);
-	TIM4->SR &= ~TIM_SR_UIF;  //clear overflow flag
 }
 
 static void tim_set_prescaler(void)
 {
+	tim_set_ticks(sump_divider_ticks(config.divider));
+}
+
+/* Capture PC6 edges on TIM8_CH1, each capture triggers a DMA request */
+static void tim_ext_clock_init(void)
+{
+	GPIO_InitTypeDef gpio_init;
+	TIM_IC_InitTypeDef ic_conf;
+
+	gpio_init.Pin = SUMP_EXT_CLOCK_PIN;
+	gpio_init.Mode = GPIO_MODE_AF_PP;
+	gpio_init.Speed = GPIO_SPEED_HIGH;
+	gpio_init.Pull = GPIO_PULLDOWN;
+	gpio_init.Alternate = GPIO_AF3_TIM8;
+	HAL_GPIO_Init(GPIOC, &gpio_init);
+
 	HAL_TIM_Base_DeInit(&htim);
-	htim.Init.Prescaler = 2*(config.divider) - 1;
-	HAL_TIM_Base_Init(&htim);
+	htim.Init.Prescaler = 0;
+	htim.Init.Period = 0xffff;
+	HAL_TIM_IC_Init(&htim);
+
+	if(config.flags & SUMP_FLAG_BOTH_EDGES) {
+		ic_conf.ICPolarity = TIM_ICPOLARITY_BOTHEDGE;
+	} else if(config.flags & SUMP_FLAG_INV_CLOCK) {
+		ic_conf.ICPolarity = TIM_ICPOLARITY_FALLING;
+	} else {
+		ic_conf.ICPolarity = TIM_ICPOLARITY_RISING;
+	}
+	ic_conf.ICSelection = TIM_ICSELECTION_DIRECTTI;
+	ic_conf.ICPrescaler = TIM_ICPSC_DIV1;
+	ic_conf.ICFilter = 0;
+	HAL_TIM_IC_ConfigChannel(&htim, &ic_conf, TIM_CHANNEL_1);
+}
+
+static void tim_ext_clock_deinit(void)
+{
+	GPIO_InitTypeDef gpio_init;
+
+	HAL_TIM_IC_DeInit(&htim);
+	tim_set_prescaler();
+
+	gpio_init.Pin = SUMP_EXT_CLOCK_PIN;
+	gpio_init.Mode = GPIO_MODE_INPUT;
+	gpio_init.Speed = GPIO_SPEED_HIGH;
+	gpio_init.Pull = GPIO_PULLDOWN;
+	gpio_init.Alternate = 0;
+	HAL_GPIO_Init(GPIOC, &gpio_init);
+}
+
+static void tim_init(void)
+{
+	htim.Instance = TIM8;
+
+	htim.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim.Init.RepetitionCounter = 0;
+
+	HAL_TIM_Base_MspInit(&htim);
+	__TIM8_CLK_ENABLE();
+	tim_set_prescaler();
 }
 
 static void sump_init(void)
 {
+	portb_init();
 	portc_init();
 	tim_init();
 }
 
-static void get_samples(void) __attribute__((optimize("-O3")));
-static void get_samples(void)
+static void sump_dma_isr(void *p, uint32_t flags)
 {
-	uint32_t config_state;
-	config_state = config.state;
+	(void)p;
+	uint8_t *next;
+
+	if((flags & STM32_DMA_ISR_TCIF) == 0) {
+		return;
+	}
+
+	/* The target just completed is free, point it two chunks ahead */
+	next = buffer + (dma_next_chunk * SUMP_CHUNK_SIZE);
+	if(dma_stream->stream->CR & DMA_SxCR_CT) {
+		dmaStreamSetMemory0(dma_stream, next);
+	} else {
+		dmaStreamSetMemory1(dma_stream, next);
+	}
+	if(++dma_next_chunk == dma_nb_chunks) {
+		dma_next_chunk = 0;
+	}
+	dma_chunks++;
+
+	chSysLockFromISR();
+	chSemSignalI(&dma_sem);
+	chSysUnlockFromISR();
+}
+
+/* Same as sump_dma_isr() for the GPIOB half of the ring */
+static void sump_dma_portb_isr(void *p, uint32_t flags)
+{
+	(void)p;
+	uint8_t *next;
+
+	if((flags & STM32_DMA_ISR_TCIF) == 0) {
+		return;
+	}
+
+	next = portb_buffer + (dma_portb_next_chunk * SUMP_CHUNK_SIZE);
+	if(dma_portb_stream->stream->CR & DMA_SxCR_CT) {
+		dmaStreamSetMemory0(dma_portb_stream, next);
+	} else {
+		dmaStreamSetMemory1(dma_portb_stream, next);
+	}
+	if(++dma_portb_next_chunk == dma_nb_chunks) {
+		dma_portb_next_chunk = 0;
+	}
+}
+
+/* Select the sample width from the enabled channel groups */
+static void sump_set_width(void)
+{
+	/* GPIOB cannot follow the external clock, groups 2 and 3 read 0 */
+	if((config.channels & 0x0c) && !external_clock) {
+		sample_width = 4;
+		sample_shift = 0;
+		/* Each half of the ring holds 16 bits per sample */
+		chunk_len = SUMP_CHUNK_SIZE / sizeof(uint16_t);
+		ring_len = SUMP_RING_SIZE / sample_width;
+		states_len = STATES_SIZE / sample_width;
+		return;
+	}
+
+	switch(config.channels & 0x03) {
+	case 0x01:
+		sample_width = 1;
+		sample_shift = 0;
+		break;
+	case 0x02:
+		sample_width = 1;
+		sample_shift = 8;
+		break;
+	default:
+		sample_width = 2;
+		sample_shift = 0;
+		break;
+	}
+	chunk_len = SUMP_CHUNK_SIZE / sample_width;
+	ring_len = SUMP_RING_SIZE / sample_width;
+	states_len = STATES_SIZE / sample_width;
+}
+
+static void dma_start(void)
+{
+	uint32_t mode;
+
+	dma_chunks = 0;
+	overruns = 0;
+	dma_next_chunk = 2;
+	dma_portb_next_chunk = 2;
+	chSemObjectInit(&dma_sem, 0);
+
+	dma_stream = external_clock ? SUMP_DMA_EXT_STREAM : SUMP_DMA_STREAM;
+	dmaStreamAllocate(dma_stream, SUMP_DMA_IRQ_PRIORITY,
+			  sump_dma_isr, NULL);
+	mode = STM32_DMA_CR_CHSEL(SUMP_DMA_CHANNEL) | STM32_DMA_CR_PL(3) |
+	       STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_MINC | STM32_DMA_CR_DBM |
+	       STM32_DMA_CR_TCIE;
+	if(sample_width == 1) {
+		/* Read only the byte of IDR holding the enabled group */
+		dmaStreamSetPeripheral(dma_stream,
+				       (uint8_t *)&GPIOC->IDR + (sample_shift / 8));
+		mode |= STM32_DMA_CR_PSIZE_BYTE | STM32_DMA_CR_MSIZE_BYTE;
+	} else {
+		dmaStreamSetPeripheral(dma_stream, &GPIOC->IDR);
+		mode |= STM32_DMA_CR_PSIZE_HWORD | STM32_DMA_CR_MSIZE_HWORD;
+	}
+	dmaStreamSetMemory0(dma_stream, buffer);
+	dmaStreamSetMemory1(dma_stream, buffer + SUMP_CHUNK_SIZE);
+	dmaStreamSetTransactionSize(dma_stream, chunk_len);
+	dmaStreamSetMode(dma_stream, mode);
+	dmaStreamClearInterrupt(dma_stream);
+	dmaStreamEnable(dma_stream);
+
+	if(sample_width == 4) {
+		dma_portb_stream = SUMP_DMA_PORTB_STREAM;
+		dmaStreamAllocate(dma_portb_stream, SUMP_DMA_IRQ_PRIORITY,
+				  sump_dma_portb_isr, NULL);
+		dmaStreamSetPeripheral(dma_portb_stream, &GPIOB->IDR);
+		dmaStreamSetMemory0(dma_portb_stream, portb_buffer);
+		dmaStreamSetMemory1(dma_portb_stream, portb_buffer + SUMP_CHUNK_SIZE);
+		dmaStreamSetTransactionSize(dma_portb_stream, chunk_len);
+		dmaStreamSetMode(dma_portb_stream, mode);
+		dmaStreamClearInterrupt(dma_portb_stream);
+		dmaStreamEnable(dma_portb_stream);
+
+		/* Match on the last tick of each period, before the update */
+		__HAL_TIM_SET_COMPARE(&htim, TIM_CHANNEL_3, htim.Init.Period);
+		__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_CC3);
+	}
+
+	__HAL_TIM_SET_COUNTER(&htim, 0);
+	if(external_clock) {
+		tim_ext_clock_init();
+		__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_CC1);
+		HAL_TIM_IC_Start(&htim, TIM_CHANNEL_1);
+	} else {
+		__HAL_TIM_ENABLE_DMA(&htim, TIM_DMA_UPDATE);
+		HAL_TIM_Base_Start(&htim);
+	}
+}
+
+static void dma_stop(void)
+{
+	if(external_clock) {
+		HAL_TIM_IC_Stop(&htim, TIM_CHANNEL_1);
+		__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_CC1);
+		tim_ext_clock_deinit();
+	} else {
+		HAL_TIM_Base_Stop(&htim);
+		__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_UPDATE);
+	}
+	dmaStreamDisable(dma_stream);
+	dmaStreamRelease(dma_stream);
+
+	if(sample_width == 4) {
+		__HAL_TIM_DISABLE_DMA(&htim, TIM_DMA_CC3);
+		dmaStreamDisable(dma_portb_stream);
+		dmaStreamRelease(dma_portb_stream);
+	}
+}
+
+/*
+ * Number of samples written by the DMA since the start of the capture.
+ * To be called with the system locked.
+ */
+static uint32_t dma_written_i(void)
+{
+	uint32_t chunks, remaining;
+
+	remaining = dmaStreamGetTransactionSize(dma_stream);
+	chunks = dma_chunks;
+	/* Transfer completed but interrupt not yet served */
+	if((DMA2->LISR >> dma_stream->ishift) & STM32_DMA_ISR_TCIF) {
+		remaining = dmaStreamGetTransactionSize(dma_stream);
+		chunks++;
+	}
+
+	return (chunks * chunk_len) + (chunk_len - remaining);
+}
+
+static uint32_t dma_written(void)
+{
+	uint32_t written;
 
-	/* Lock Kernel for logic analyzer */
 	chSysLock();
+	written = dma_written_i();
+	chSysUnlock();
 
-	HAL_TIM_Base_Start(&htim);
+	return written;
+}
 
-	if(config_state == SUMP_STATE_ARMED)
-	{
-		uint32_t config_trigger_value;
-		uint32_t config_trigger_mask;
+static inline uint32_t get_sample(uint32_t index)
+{
+	switch(sample_width) {
+	case 1:
+		return sample_buf[index] << sample_shift;
+	case 2:
+		return ((uint16_t *)sample_buf)[index];
+	default:
+		return ((uint16_t *)buffer)[index] |
+		       ((((uint16_t *)portb_buffer)[index] & SUMP_PORTB_MASK) << 16);
+	}
+}
+
+static void sump_trigger_setup(void)
+{
+	uint32_t i;
 
-		config_trigger_value =  config.trigger_values[0];
-		config_trigger_mask = config.trigger_masks[0];
+	trigger_width = MIN(sample_width, 2);
+	for(i = 0; i < SUMP_TRIGGER_STAGES; i++) {
+		trigger_seq.stages[i].mask = config.trigger_masks[i];
+		trigger_seq.stages[i].value = config.trigger_values[i];
+		trigger_seq.stages[i].edge = config.trigger_edges[i];
+		trigger_seq.stages[i].config = config.trigger_configs[i];
 
-		while(1)
-		{
-			while( !(TIM4->SR & TIM_SR_UIF)) {
-				//Wait for timer...
+		/* Merge GPIOB samples only when the trigger looks at them */
+		if((config.trigger_masks[i] | config.trigger_edges[i]) & 0xffff0000) {
+			trigger_width = sample_width;
+		}
+		if((config.trigger_configs[i] & SUMP_TRIG_CFG_SERIAL) &&
+		   (SUMP_TRIG_CFG_CHANNEL(config.trigger_configs[i]) >= 16)) {
+			trigger_width = sample_width;
+		}
+	}
+	sump_trigger_init(&trigger_seq);
+}
+
+static void hw_trigger_cb(EXTDriver *extp, expchannel_t channel)
+{
+	chSysLockFromISR();
+	extChannelDisableI(extp, channel);
+	hw_trigger_pos = dma_written_i();
+	chSemSignalI(&hw_trigger_sem);
+	chSysUnlockFromISR();
+}
+
+/* Samples taken during the EXTI latency, within the ring guard */
+static uint32_t hw_trigger_window(void)
+{
+	uint32_t max, window;
+
+	max = (dma_nb_chunks - SUMP_GUARD_CHUNKS - 1) * chunk_len;
+	if(external_clock) {
+		/* Unknown sample rate */
+		return max;
+	}
+	window = ((SUMP_TIM_CLOCK / 1000000) * SUMP_HW_TRIGGER_LATENCY_US) /
+		 sample_ticks + 1;
+	return MIN(window, max);
+}
+
+/*
+ * Arm an EXTI interrupt when the trigger is a single stage matching one
+ * PC0-14 line, by level or by edge. Must be called once the DMA runs.
+ */
+static bool hw_trigger_arm(void)
+{
+	const sump_trigger_stage *stage;
+	uint32_t bit, line, i;
+
+	stage = &trigger_seq.stages[0];
+	bit = stage->mask | stage->edge;
+	if((trigger_seq.active != 0x01) ||
+	   ((stage->config & ~SUMP_TRIG_CFG_CHANNEL_MASK) != SUMP_TRIG_CFG_START) ||
+	   (bit == 0) || (bit & (bit - 1)) || (bit & ~0x7fff) ||
+	   (stage->edge & ~bit) || (EXTD1.state == EXT_ACTIVE)) {
+		return FALSE;
+	}
+
+	line = __builtin_ctz(bit);
+	for(i = 0; i < EXT_MAX_CHANNELS; i++) {
+		hw_trigger_extcfg.channels[i].mode = EXT_CH_MODE_DISABLED;
+		hw_trigger_extcfg.channels[i].cb = NULL;
+	}
+	hw_trigger_extcfg.channels[line].mode = EXT_CH_MODE_AUTOSTART |
+						EXT_MODE_GPIOC |
+						((stage->value & bit) ?
+						 EXT_CH_MODE_RISING_EDGE :
+						 EXT_CH_MODE_FALLING_EDGE);
+	hw_trigger_extcfg.channels[line].cb = hw_trigger_cb;
+
+	chSemObjectInit(&hw_trigger_sem, 0);
+	extStart(&EXTD1, &hw_trigger_extcfg);
+
+	/* A level trigger already matching fires at once */
+	if((stage->edge == 0) && !((GPIOC->IDR ^ stage->value) & bit)) {
+		chSysLock();
+		extChannelDisableI(&EXTD1, line);
+		hw_trigger_pos = dma_written_i();
+		chSemSignalI(&hw_trigger_sem);
+		chSysUnlock();
+	}
+	return TRUE;
+}
+
+/* Samples of a chunk in the format expected by the trigger */
+static const void *trigger_samples(uint32_t chunk_index)
+{
+	const uint16_t *portc, *portb;
+	uint32_t i;
+
+	portc = (const uint16_t *)(buffer + (chunk_index * SUMP_CHUNK_SIZE));
+	if(trigger_width != 4) {
+		return portc;
+	}
+
+	portb = (const uint16_t *)(portb_buffer + (chunk_index * SUMP_CHUNK_SIZE));
+	for(i = 0; i < chunk_len; i++) {
+		trigger_merge[i] = portc[i] | ((portb[i] & SUMP_PORTB_MASK) << 16);
+	}
+	return trigger_merge;
+}
+
+/* Return FALSE when interrupted before the trigger */
+static bool get_samples(void) __attribute__((optimize("-O3")));
+static bool get_samples(void)
+{
+	bool triggered, hw_armed, hw_trigger;
+	const uint8_t *samples;
+	uint32_t delay_count;
+	uint32_t chunk, offset, start, trigger, trigger_index;
+	uint32_t remaining;
+	uint64_t sleep;
+	int32_t match;
+
+	sump_set_width();
+	sump_trigger_setup();
+	if(sample_width == 4) {
+		dma_nb_chunks = SUMP_NB_CHUNKS / 2;
+		tim_set_ticks(MAX(sump_divider_ticks(config.divider),
+				  SUMP_WIDE_MIN_TICKS));
+	} else {
+		dma_nb_chunks = SUMP_NB_CHUNKS;
+		tim_set_prescaler();
+	}
+	sample_buf = buffer;
+	delay_count = MIN(config.delay_count, states_len);
+	config.read_count = MIN(config.read_count, states_len);
+
+	dma_start();
+	hw_armed = hw_trigger_arm();
+	hw_trigger = hw_armed;
+
+	/* Look for the trigger in each chunk filled by the DMA */
+	chunk = 0;
+	offset = 0;
+	trigger = 0;
+	trigger_index = 0;
+	while(config.state == SUMP_STATE_ARMED) {
+		if(hw_trigger) {
+			/* Sleep until the EXTI fires */
+			if(chSemWaitTimeout(&hw_trigger_sem, MS2ST(100)) != MSG_OK) {
+				if(USER_BUTTON) {
+					config.state = SUMP_STATE_IDLE;
+				}
+				continue;
 			}
+			hw_trigger = FALSE;
+			/* Drop the signals of the chunks filled while sleeping */
+			chSemReset(&dma_sem, 0);
+			start = hw_trigger_pos - MIN(hw_trigger_pos, hw_trigger_window());
+			chunk = start / chunk_len;
+			offset = start % chunk_len;
+		}
 
-			*(buffer+INDEX) = GPIOC->IDR;
-			TIM4->SR &= ~TIM_SR_UIF;  //clear overflow flag
-			if ( !((*(buffer+INDEX) ^ config_trigger_value) & config_trigger_mask) ) {
-				config_state = SUMP_STATE_TRIGGED;
+		if(chunk == dma_chunks) {
+			if(chSemWaitTimeout(&dma_sem, MS2ST(100)) != MSG_OK) {
+				if(USER_BUTTON) {
+					config.state = SUMP_STATE_IDLE;
+				}
+			}
+			continue;
+		}
+
+		/* Chunks overwritten before being scanned are dropped */
+		if((dma_chunks - chunk) > (dma_nb_chunks - SUMP_GUARD_CHUNKS)) {
+			overruns += dma_chunks - chunk - 1;
+			chunk = dma_chunks - 1;
+			offset = 0;
+		}
+		samples = trigger_samples(chunk % dma_nb_chunks);
+		match = sump_trigger_scan(&trigger_seq,
+					  samples + (offset * trigger_width),
+					  chunk_len - offset, trigger_width,
+					  sample_shift);
+		if(match >= 0) {
+			match += offset;
+			trigger = (chunk * chunk_len) + match;
+			trigger_index = ((chunk % dma_nb_chunks) * chunk_len) + match;
+			config.state = SUMP_STATE_TRIGGED;
+		}
+		offset = 0;
+		chunk++;
+	}
+	if(hw_armed) {
+		extStop(&EXTD1);
+	}
+
+	triggered = (config.state == SUMP_STATE_TRIGGED);
+
+	/* Wait for delay_count samples after the trigger */
+	while(config.state == SUMP_STATE_TRIGGED) {
+		remaining = dma_written() - (trigger + 1);
+		if(remaining >= delay_count) {
+			break;
+		}
+		remaining = delay_count - remaining;
+
+		/* Sleep while more than one system tick of samples is missing */
+		if(external_clock) {
+			/* Unknown sample rate */
+			sleep = 2;
+		} else {
+			sleep = ((uint64_t)remaining * sample_ticks) /
+				(SUMP_TIM_CLOCK / CH_CFG_ST_FREQUENCY);
+		}
+		if(sleep > 1) {
+			chThdSleep((systime_t)MIN(sleep - 1, MS2ST(100)));
+			if(USER_BUTTON) {
 				break;
 			}
-			INDEX++;
-			INDEX &= STATES_LEN-1;
 		}
 	}
 
-	if(config_state == SUMP_STATE_TRIGGED)
-	{
-		register uint32_t config_delay_count = config.delay_count;
+	dma_stop();
 
-		while(config_delay_count > 0)
-		{
-			while( !(TIM4->SR & TIM_SR_UIF)) {
-				//Wait for timer...
+	INDEX = (trigger_index + 1 + delay_count) % ring_len;
+	capture_len = config.read_count;
+	capture_start = (INDEX + ring_len - capture_len) % ring_len;
+	config.state = SUMP_STATE_IDLE;
+	return triggered;
+}
+
+static void rle_put(uint32_t item)
+{
+	if(sample_width == 1) {
+		sample_buf[rle_index] = item;
+	} else {
+		((uint16_t *)sample_buf)[rle_index] = item;
+	}
+	if(++rle_index == ring_len) {
+		rle_index = 0;
+	}
+	rle_items++;
+}
+
+/* Store the current run as a value followed by a repeat count */
+static void rle_flush(void)
+{
+	if(rle_count == 0) {
+		return;
+	}
+	rle_put(rle_value);
+	if(rle_count > 1) {
+		rle_put(rle_flag | (rle_count - 1));
+	}
+	rle_count = 0;
+}
+
+static void rle_compress(uint32_t chunk, uint32_t start, uint32_t end) __attribute__((optimize("-O3")));
+static void rle_compress(uint32_t chunk, uint32_t start, uint32_t end)
+{
+	uint8_t *samples8;
+	uint16_t *samples16;
+	uint32_t value, mask;
+	uint32_t i;
+
+	/* The sample MSB flags a repeat count, that channel is lost */
+	mask = rle_flag - 1;
+	samples8 = buffer + (chunk * SUMP_CHUNK_SIZE);
+	samples16 = (uint16_t *)samples8;
+
+	for(i = start; i < end; i++) {
+		if(sample_width == 1) {
+			value = samples8[i] & mask;
+		} else {
+			value = samples16[i] & mask;
+		}
+		if((rle_count > 0) && (value == rle_value) && (rle_count <= mask)) {
+			rle_count++;
+			continue;
+		}
+		rle_flush();
+		rle_value = value;
+		rle_count = 1;
+	}
+}
+
+/*
+ * RLE capture: the DMA fills a small ring of raw samples which are
+ * compressed in the rest of the buffer as each chunk completes.
+ * delay_count and read_count are then numbers of RLE samples.
+ */
+static void get_samples_rle(void) __attribute__((optimize("-O3")));
+static void get_samples_rle(void)
+{
+	uint32_t delay_count;
+	uint32_t chunk, chunk_index;
+	uint32_t trigger_item, trigger_index;
+	int32_t match;
+
+	capture_len = 0;
+
+	sump_set_width();
+	sump_trigger_setup();
+	dma_nb_chunks = SUMP_RLE_RAW_CHUNKS;
+	sample_buf = buffer + (SUMP_RLE_RAW_CHUNKS * SUMP_CHUNK_SIZE);
+	ring_len = SUMP_RLE_SIZE / sample_width;
+	/* Keep room for the samples compressed while stopping */
+	states_len = ring_len - (2 * chunk_len);
+	delay_count = MIN(config.delay_count, states_len);
+	config.read_count = MIN(config.read_count, states_len);
+
+	rle_flag = (sample_width == 1) ? 0x80 : 0x8000;
+	rle_index = 0;
+	rle_items = 0;
+	rle_count = 0;
+	trigger_item = 0;
+	trigger_index = 0;
+
+	dma_start();
+
+	chunk = 0;
+	while(config.state != SUMP_STATE_IDLE) {
+		if(chSemWaitTimeout(&dma_sem, MS2ST(100)) != MSG_OK) {
+			if(USER_BUTTON) {
+				break;
+			}
+			continue;
+		}
+
+		while((chunk != dma_chunks) && (config.state != SUMP_STATE_IDLE)) {
+			/* Chunks overwritten before being compressed are dropped */
+			if((dma_chunks - chunk) > (SUMP_RLE_RAW_CHUNKS - SUMP_GUARD_CHUNKS)) {
+				overruns += dma_chunks - chunk - 1;
+				chunk = dma_chunks - 1;
+			}
+			chunk_index = chunk % SUMP_RLE_RAW_CHUNKS;
+
+			match = -1;
+			if(config.state == SUMP_STATE_ARMED) {
+				match = sump_trigger_scan(&trigger_seq,
+							  buffer + (chunk_index * SUMP_CHUNK_SIZE),
+							  chunk_len, sample_width, sample_shift);
+			}
+			if(match >= 0) {
+				/* The trigger sample starts a new run */
+				rle_compress(chunk_index, 0, match);
+				rle_flush();
+				trigger_item = rle_items;
+				trigger_index = rle_index;
+				config.state = SUMP_STATE_TRIGGED;
+				rle_compress(chunk_index, match, chunk_len);
+			} else {
+				rle_compress(chunk_index, 0, chunk_len);
 			}
+			chunk++;
 
-			*(buffer+INDEX) = GPIOC->IDR;
-			TIM4->SR &= ~TIM_SR_UIF;  //clear overflow flag
-			config_delay_count--;
-			INDEX++;
-			INDEX &= STATES_LEN-1;
+			if((config.state == SUMP_STATE_TRIGGED) &&
+			   ((rle_items - trigger_item) > delay_count)) {
+				config.state = SUMP_STATE_IDLE;
+			}
 		}
 	}
 
-	chSysUnlock();
+	dma_stop();
+	rle_flush();
+
+	if(config.state == SUMP_STATE_IDLE) {
+		INDEX = (trigger_index + 1 + delay_count) % ring_len;
+	} else {
+		INDEX = rle_index;
+	}
 	config.state = SUMP_STATE_IDLE;
-	HAL_TIM_Base_Stop(&htim);
+}
+
+static void ts_extcb(EXTDriver *extp, expchannel_t channel)
+{
+	(void)extp;
+	(void)channel;
+	uint32_t time, value;
+	sump_ts_record *rec;
+
+	time = get_cyclecounter();
+	value = GPIOC->IDR & ts_mask;
+
+	/* Several lines changed at once or glitch, already recorded */
+	if(value == ts_records[(ts_count - 1) % SUMP_TS_RECORDS].value) {
+		return;
+	}
+	rec = &ts_records[ts_count % SUMP_TS_RECORDS];
+	rec->time = time;
+	rec->value = value;
+	ts_count++;
+
+	if((ts_state == SUMP_STATE_ARMED) &&
+	   !((value ^ config.trigger_values[0]) & config.trigger_masks[0])) {
+		ts_trigger_time = time;
+		ts_state = SUMP_STATE_TRIGGED;
+	}
+}
+
+/*
+ * Timestamp capture: an EXTI interrupt on both edges of each enabled
+ * GPIOC line records the transitions, the trigger being a level match
+ * of stage 0. Samples at the SUMP rate are rebuilt by ts_get_sample().
+ */
+static void get_samples_ts(void)
+{
+	uint32_t i, delay_count, remaining;
+
+	capture_len = 0;
+	overruns = 0;
+	ts_mask = 0;
+	if(config.channels & 0x01) {
+		ts_mask |= 0x00ff;
+	}
+	if(config.channels & 0x02) {
+		ts_mask |= 0x7f00;
+	}
+	sample_width = 2;
+	sample_shift = 0;
+
+	/* SUMP divider is relative to a 100MHz clock */
+	ts_period = (config.divider + 1) * (STM32_SYSCLK / 1000000);
+	config.read_count = MIN(config.read_count,
+				((uint64_t)SUMP_TS_MAX_WINDOW * 100) / ts_period);
+	delay_count = MIN(config.delay_count, config.read_count);
+
+	for(i = 0; i < EXT_MAX_CHANNELS; i++) {
+		if((i < 16) && (ts_mask & (1 << i))) {
+			ts_extcfg.channels[i].mode = EXT_CH_MODE_BOTH_EDGES |
+						     EXT_CH_MODE_AUTOSTART |
+						     EXT_MODE_GPIOC;
+			ts_extcfg.channels[i].cb = ts_extcb;
+		} else {
+			ts_extcfg.channels[i].mode = EXT_CH_MODE_DISABLED;
+			ts_extcfg.channels[i].cb = NULL;
+		}
+	}
+
+	/* Initial state of the port */
+	ts_records[0].time = get_cyclecounter();
+	ts_records[0].value = GPIOC->IDR & ts_mask;
+	ts_count = 1;
+	ts_trigger_time = ts_records[0].time;
+	if(!((ts_records[0].value ^ config.trigger_values[0]) & config.trigger_masks[0])) {
+		ts_state = SUMP_STATE_TRIGGED;
+	} else {
+		ts_state = SUMP_STATE_ARMED;
+	}
+
+	extStart(&EXTD1, &ts_extcfg);
+
+	while(ts_state == SUMP_STATE_ARMED) {
+		chThdSleepMilliseconds(1);
+		if(USER_BUTTON) {
+			break;
+		}
+	}
+
+	/* Record delay_count sample periods after the trigger */
+	ts_end_time = ts_trigger_time + (((uint64_t)delay_count * ts_period) / 100);
+	while(ts_state == SUMP_STATE_TRIGGED) {
+		remaining = ts_end_time - get_cyclecounter();
+		if((int32_t)remaining <= 0) {
+			break;
+		}
+		chThdSleepMicroseconds(MIN(remaining / (STM32_SYSCLK / 1000000) + 1,
+					   100000));
+		if(USER_BUTTON) {
+			break;
+		}
+	}
+	extStop(&EXTD1);
+
+	if(ts_state != SUMP_STATE_TRIGGED) {
+		ts_end_time = get_cyclecounter();
+	}
+	ts_index = ts_count - 1;
+	config.state = SUMP_STATE_IDLE;
+}
+
+/* Port value n sample periods before the end of the capture */
+static uint32_t ts_get_sample(uint32_t n)
+{
+	uint32_t time, oldest;
+
+	time = ts_end_time - (((uint64_t)n * ts_period) / 100);
+	oldest = (ts_count > SUMP_TS_RECORDS) ? (ts_count - SUMP_TS_RECORDS) : 0;
+
+	/* Samples are requested newest first, walk the records backward */
+	while((ts_index > oldest) &&
+	      ((int32_t)(ts_records[ts_index % SUMP_TS_RECORDS].time - time) > 0)) {
+		ts_index--;
+	}
+	return ts_records[ts_index % SUMP_TS_RECORDS].value;
+}
+
+/*
+ * Send read_count samples back to the client, newest first, packed in
+ * large writes. Only the enabled channel groups are sent for each sample.
+ */
+static void sump_readback(t_hydra_console *con)
+{
+	uint8_t tx_buf[SUMP_TX_LEN];
+	uint32_t channels, sample, len;
+	uint32_t start, count;
+
+	channels = config.channels;
+	upload_bytes = 0;
+	len = 0;
+
+	start = get_cyclecounter();
+	for(count = 0; count < config.read_count; count++) {
+		if (INDEX == 0) {
+			INDEX = ring_len-1;
+		} else {
+			INDEX--;
+		}
+		if(timestamp_mode) {
+			sample = ts_get_sample(count);
+		} else if(rle_mode && (count >= rle_items)) {
+			/* Pad with empty repeat counts */
+			sample = rle_flag << sample_shift;
+		} else {
+			sample = get_sample(INDEX);
+		}
+
+		if(channels & 0x01) {
+			tx_buf[len++] = sample & 0xff;
+		}
+		if(channels & 0x02) {
+			tx_buf[len++] = (sample >> 8) & 0xff;
+		}
+		if(channels & 0x04) {
+			tx_buf[len++] = (sample >> 16) & 0xff;
+		}
+		if(channels & 0x08) {
+			tx_buf[len++] = (sample >> 24) & 0xff;
+		}
+		if(len > SUMP_TX_LEN - 4) {
+			cprint(con, (char *)tx_buf, len);
+			upload_bytes += len;
+			len = 0;
+		}
+	}
+	config.read_count = 0;
+	cprint(con, (char *)tx_buf, len);
+	upload_bytes += len;
+	upload_cycles = get_cyclecounter() - start;
+}
+
+/*
+ * Streaming mode: each chunk filled by the DMA is pushed to USB by this
+ * thread. When USB is too slow the chunks overwritten before being sent
+ * are skipped and counted.
+ */
+static msg_t stream_thread(void *arg)
+{
+	t_hydra_console *con;
+	uint32_t chunk;
+
+	con = arg;
+	chRegSetThreadName("SUMP stream");
+	chunk = 0;
+
+	while(!chThdShouldTerminateX()) {
+		if(chSemWaitTimeout(&dma_sem, MS2ST(10)) != MSG_OK) {
+			continue;
+		}
+		while(chunk != dma_chunks) {
+			if((dma_chunks - chunk) > (SUMP_NB_CHUNKS - SUMP_GUARD_CHUNKS)) {
+				overruns += dma_chunks - chunk - 1;
+				chunk = dma_chunks - 1;
+			}
+			cprint(con, (char *)buffer + ((chunk % SUMP_NB_CHUNKS) * SUMP_CHUNK_SIZE),
+			       SUMP_CHUNK_SIZE);
+			/* Chunk partially overwritten while it was sent */
+			if((dma_chunks - chunk) > (SUMP_NB_CHUNKS - 1)) {
+				overruns++;
+			}
+			chunk++;
+			stream_chunks++;
+		}
+	}
+	return (msg_t)1;
+}
+
+static void sump_stream(t_hydra_console *con, uint32_t frequency)
+{
+	thread_t *thread;
+
+	if(frequency == 0) {
+		cprintf(con, "Invalid frequency.\r\n");
+		return;
+	}
+
+	config.channels = 0x03;
+	external_clock = FALSE;
+	sump_set_width();
+	dma_nb_chunks = SUMP_NB_CHUNKS;
+	tim_set_ticks(SUMP_TIM_CLOCK / frequency);
+	stream_chunks = 0;
+
+	cprintf(con, "Streaming at %d Hz, interrupt by pressing user button.\r\n",
+		SUMP_TIM_CLOCK / sample_ticks);
+
+	/* dma_start() initializes dma_sem used by the thread */
+	dma_start();
+	thread = chThdCreateFromHeap(NULL, CONSOLE_WA_SIZE, "sump_stream",
+				     NORMALPRIO, (tfunc_t)stream_thread, con);
+	while(!USER_BUTTON) {
+		chThdSleepMilliseconds(10);
+	}
+	dma_stop();
+	chThdTerminate(thread);
+	chThdWait(thread);
+
+	cprintf(con, "\r\nStream stopped: %d samples sent, %d chunks lost (%d samples per chunk)\r\n",
+		stream_chunks * chunk_len, overruns, chunk_len);
 }
 
 static void sump_deinit(void)
@@ -147,19 +1155,189 @@ static void sump_deinit(void)
 
 	HAL_TIM_Base_Stop(&htim);
 	HAL_TIM_Base_DeInit(&htim);
-	__TIM4_CLK_DISABLE();
+	__TIM8_CLK_DISABLE();
 	for(gpio_pin=0; gpio_pin<15; gpio_pin++) {
 		HAL_GPIO_DeInit(hal_gpio_port, 1 << gpio_pin);
 	}
+	for(gpio_pin = 0; gpio_pin < SUMP_PORTB_PINS; gpio_pin++) {
+		HAL_GPIO_DeInit(GPIOB, 1 << gpio_pin);
+	}
+	/* PC8-PC12 are sampled but belong to the SDIO */
+	sd_gpio_init();
+}
+
+/* Number of samples of the last raw capture, 0 after a RLE or timestamp run */
+uint32_t sump_capture_len(uint32_t *width)
+{
+	*width = sample_width;
+	return capture_len;
+}
+
+/* Sample n of the last raw capture, oldest first */
+uint32_t sump_capture_sample(uint32_t n)
+{
+	return get_sample((capture_start + n) % ring_len);
 }
 
-int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p) __attribute__((optimize("-O3")));
-int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p)
+/*
+ * Capture with the trigger, channel groups and clock left by the last
+ * SUMP session and save the samples starting at the trigger on the
+ * microSD. RLE and timestamp modes are not used here.
+ */
+static void sump_record(t_hydra_console *con, const char *filename,
+			uint32_t samples, uint32_t frequency)
 {
+	sump_file_capture cap;
+	uint32_t i;
+
+	if((config.channels & 0x0f) == 0) {
+		config.channels = 0x03;
+	}
+	/* Start immediately when no trigger stage has been configured */
+	for(i = 0; i < SUMP_TRIGGER_STAGES; i++) {
+		if(config.trigger_masks[i] || config.trigger_edges[i] ||
+		   (config.trigger_configs[i] & SUMP_TRIG_CFG_START)) {
+			break;
+		}
+	}
+	if(i == SUMP_TRIGGER_STAGES) {
+		config.trigger_configs[0] = SUMP_TRIG_CFG_START;
+	}
+	if(frequency > 0) {
+		frequency = MIN(frequency, SUMP_MAX_SAMPLE_RATE);
+		config.divider = (100000000 / frequency) - 1;
+	}
+
+	external_clock = !!(config.flags & SUMP_FLAG_EXT_CLOCK);
+	sump_set_width();
+	if((samples == 0) || (samples > states_len)) {
+		samples = states_len;
+	}
+	config.read_count = samples;
+	config.delay_count = samples - 1;
+
+	cprintf(con, "Waiting for trigger, interrupt by pressing user button.\r\n");
+	config.state = SUMP_STATE_ARMED;
+	if(!get_samples()) {
+		cprintf(con, "Capture interrupted.\r\n");
+		return;
+	}
+	/* Wait for the button release before the next command */
+	while(USER_BUTTON) {
+		chThdSleepMilliseconds(10);
+	}
+
+	cap.nb_samples = capture_len;
+	cap.rate = external_clock ? 0 :
+		   (SUMP_TIM_CLOCK + (sample_ticks / 2)) / sample_ticks;
+	cap.channels = 0;
+	for(i = 0; i < 4; i++) {
+		if(config.channels & (1 << i)) {
+			cap.channels |= 0xff << (i * 8);
+		}
+	}
+	/* PC15 is not sampled, neither are PB12-15 */
+	cap.channels &= ~(1 << 15);
+	if(sample_width == 4) {
+		cap.channels &= 0x0fffffff;
+		cap.width = 4;
+	} else {
+		cap.channels &= 0xffff;
+		cap.width = 2;
+	}
+	cap.get_sample = sump_capture_sample;
+	sd_gpio_init();
+	sump_file_save(con, filename, &cap);
+}
+
+/* Rates the timer really produces for the divider sent by the client */
+static void sump_show_rates(t_hydra_console *con)
+{
+	uint32_t i, divider, ticks, actual;
+	int32_t error;
+
+	cprintf(con, "Requested\tDivider\tTicks\tActual\t\tError (ppm)\r\n");
+	for(i = 0; i < ARRAY_SIZE(sump_rates); i++) {
+		divider = (100000000 / sump_rates[i]) - 1;
+		ticks = sump_divider_ticks(divider);
+		actual = (SUMP_TIM_CLOCK + (ticks / 2)) / ticks;
+		error = ((int64_t)actual - sump_rates[i]) * 1000000 / sump_rates[i];
+		cprintf(con, "%d\t%d\t%d\t%d\t%d\r\n", sump_rates[i],
+			divider, ticks, actual, error);
+	}
+}
+
+int cmd_sump(t_hydra_console *con, t_tokenline_parsed *p) __attribute__((optimize("-O3")));
+int cmd_sump(t_hydra_console *con, t_tokenline_parsed *p)
+{
+
+	uint32_t frequency = 100000;
+	uint32_t samples = 0;
+	uint32_t rate;
+	uint32_t upload_us;
+	bool stream = FALSE;
+	bool frequency_set = FALSE;
+	char *filename = NULL;
+	int str_offset;
+	int t = 1;
+
+	timestamp_mode = FALSE;
+
+	while(p->tokens[t]) {
+		switch(p->tokens[t++]) {
+		case T_STREAM:
+			stream = TRUE;
+			break;
+		case T_TIMESTAMP:
+			timestamp_mode = TRUE;
+			break;
+		case T_RATES:
+			sump_show_rates(con);
+			return TRUE;
+		case T_FREQUENCY:
+			t += 1;
+			memcpy(&frequency, p->buf + p->tokens[t++], sizeof(uint32_t));
+			frequency_set = TRUE;
+			break;
+		case T_FILE:
+			t += 1;
+			memcpy(&str_offset, &p->tokens[t++], sizeof(int));
+			filename = p->buf + str_offset;
+			break;
+		case T_SAMPLES:
+			t += 1;
+			memcpy(&samples, p->buf + p->tokens[t++], sizeof(uint32_t));
+			break;
+		}
+	}
+
+	if(timestamp_mode && (EXTD1.state == EXT_ACTIVE)) {
+		cprintf(con, "EXTI already in use.\r\n");
+		return FALSE;
+	}
 
 	sump_init();
 	config.state = SUMP_STATE_IDLE;
 
+	if(stream) {
+		sump_stream(con, frequency);
+		sump_deinit();
+		return TRUE;
+	}
+
+	if(filename != NULL) {
+		timestamp_mode = FALSE;
+		sump_record(con, filename, samples, frequency_set ? frequency : 0);
+		sump_deinit();
+		return TRUE;
+	}
+
+	/* Stage 0 alone starts the capture until configured by the client */
+	memset(config.trigger_configs, 0, sizeof(config.trigger_configs));
+	memset(config.trigger_edges, 0, sizeof(config.trigger_edges));
+	config.trigger_configs[0] = SUMP_TRIG_CFG_START;
+	upload_bytes = 0;
+
 	uint8_t sump_command;
 	uint8_t sump_parameters[4] = {0};
 	uint32_t index=0;
@@ -176,51 +1354,45 @@ int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p
 				cprintf(con, "1ALS");
 				break;
 			case SUMP_RUN:
-				INDEX=0;
 				config.state = SUMP_STATE_ARMED;
-				get_samples();
-
-				while(config.read_count > 0) {
-					if (INDEX == 0) {
-						INDEX = STATES_LEN-1;
-					} else {
-						INDEX--;
-					}
-					switch (config.channels) {
-					case 1:
-						cprintf(con, "%c\x00\x00\x00", *(buffer+INDEX) & 0xff);
-						break;
-					case 2:
-						cprintf(con, "%c\x00\x00\x00", (*(buffer+INDEX) & 0xff00)>>8);
-						break;
-					case 3:
-						cprintf(con, "%c%c\x00\x00", *(buffer+INDEX) & 0xff, (*(buffer+INDEX) & 0xff00)>>8);
-						break;
-					}
-					config.read_count--;
+				external_clock = !!(config.flags & SUMP_FLAG_EXT_CLOCK);
+				/*
+				 * Channel 31 is always 0 in 32 channels mode, raw
+				 * samples are then valid RLE data.
+				 */
+				rle_mode = (config.flags & SUMP_FLAG_RLE) &&
+					   !(config.channels & 0x0c);
+				if(timestamp_mode) {
+					get_samples_ts();
+				} else if(rle_mode) {
+					get_samples_rle();
+				} else {
+					get_samples();
 				}
+				sump_readback(con);
 				break;
 			case SUMP_DESC:
 				// device name string
 				cprintf(con, "%c", 0x01);
 				cprintf(con, "HydraBus");
 				cprintf(con, "%c", 0x00);
-				//sample memory (8192)
+				//sample memory (bytes)
 				cprintf(con, "%c", 0x21);
-				cprintf(con, "%c", 0x00);
-				cprintf(con, "%c", 0x00);
-				cprintf(con, "%c", 0x20);
-				cprintf(con, "%c", 0x00);
-				//sample rate (2MHz)
+				cprintf(con, "%c", (STATES_SIZE >> 24) & 0xff);
+				cprintf(con, "%c", (STATES_SIZE >> 16) & 0xff);
+				cprintf(con, "%c", (STATES_SIZE >> 8) & 0xff);
+				cprintf(con, "%c", STATES_SIZE & 0xff);
+				//sample rate
+				rate = timestamp_mode ? SUMP_TS_MAX_SAMPLE_RATE : SUMP_MAX_SAMPLE_RATE;
 				cprintf(con, "%c", 0x23);
-				cprintf(con, "%c", 0x00);
-				cprintf(con, "%c", 0x1E);
-				cprintf(con, "%c", 0x84);
-				cprintf(con, "%c", 0x80);
+				cprintf(con, "%c", (rate >> 24) & 0xff);
+				cprintf(con, "%c", (rate >> 16) & 0xff);
+				cprintf(con, "%c", (rate >> 8) & 0xff);
+				cprintf(con, "%c", rate & 0xff);
 				//b
-				//number of probes (16)
+				//number of probes (32)
 				cprintf(con, "%c", 0x40);
-				cprintf(con, "%c", 0x10);
+				cprintf(con, "%c", 0x20);
 				//protocol version (2)
 				cprintf(con, "%c", 0x41);
 				cprintf(con, "%c", 0x02);
@@ -262,6 +1434,34 @@ int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p
 						config.trigger_values[index] <<= 8;
 						config.trigger_values[index] |= sump_parameters[0];
 						break;
+					case SUMP_TRIG_CFG_1:
+					case SUMP_TRIG_CFG_2:
+					case SUMP_TRIG_CFG_3:
+					case SUMP_TRIG_CFG_4:
+						// Get the trigger index
+						index = (sump_command & 0x0c) >> 2;
+						config.trigger_configs[index] = sump_parameters[3];
+						config.trigger_configs[index] <<= 8;
+						config.trigger_configs[index] |= sump_parameters[2];
+						config.trigger_configs[index] <<= 8;
+						config.trigger_configs[index] |= sump_parameters[1];
+						config.trigger_configs[index] <<= 8;
+						config.trigger_configs[index] |= sump_parameters[0];
+						break;
+					case SUMP_TRIG_EDGE_1:
+					case SUMP_TRIG_EDGE_2:
+					case SUMP_TRIG_EDGE_3:
+					case SUMP_TRIG_EDGE_4:
+						// Get the trigger index
+						index = (sump_command & 0x0c) >> 2;
+						config.trigger_edges[index] = sump_parameters[3];
+						config.trigger_edges[index] <<= 8;
+						config.trigger_edges[index] |= sump_parameters[2];
+						config.trigger_edges[index] <<= 8;
+						config.trigger_edges[index] |= sump_parameters[1];
+						config.trigger_edges[index] <<= 8;
+						config.trigger_edges[index] |= sump_parameters[0];
+						break;
 					case SUMP_CNT:
 						config.delay_count = sump_parameters[3];
 						config.delay_count <<= 8;
@@ -279,13 +1479,13 @@ int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p
 						config.divider |= sump_parameters[1];
 						config.divider <<= 8;
 						config.divider |= sump_parameters[0];
-						config.divider /= 50; /* Assuming 100MHz base frequency */
-						config.divider++;
 						tim_set_prescaler();
 						break;
 					case SUMP_FLAGS:
+						config.flags = sump_parameters[1];
+						config.flags <<= 8;
+						config.flags |= sump_parameters[0];
 						config.channels = (~sump_parameters[0] >> 2) & 0x0f;
-						/* not implemented */
 						break;
 					default:
 						break;
@@ -296,6 +1496,30 @@ int cmd_sump(t_hydra_console *con, __attribute__((unused)) t_tokenline_parsed *p
 		}
 	}
 	sump_deinit();
+
+	if(upload_bytes > 0) {
+		upload_us = upload_cycles / (STM32_SYSCLK / 1000000);
+		cprintf(con, "Last upload: %d bytes in %d us", upload_bytes, upload_us);
+		if(upload_us > 0) {
+			cprintf(con, " (%d kB/s)", (upload_bytes * 1000) / upload_us);
+		}
+		cprintf(con, "\r\n");
+	}
+	if(upload_bytes > 0 && !timestamp_mode) {
+		if(external_clock) {
+			cprintf(con, "Last capture: external clock\r\n");
+		} else {
+			cprintf(con, "Last capture: %d Hz\r\n",
+				(SUMP_TIM_CLOCK + (sample_ticks / 2)) / sample_ticks);
+		}
+	}
+	if(timestamp_mode && (ts_count > SUMP_TS_RECORDS)) {
+		cprintf(con, "Last capture: %d transitions, only the last %d kept\r\n",
+			ts_count, SUMP_TS_RECORDS);
+	}
+	if(overruns > 0) {
+		cprintf(con, "Overruns: %d chunks lost\r\n", overruns);
+	}
 	return TRUE;
 }
 
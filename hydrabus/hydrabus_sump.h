@@ -33,6 +33,21 @@
 #define SUMP_TRIG_VALS_2  0xc5
 #define SUMP_TRIG_VALS_3  0xc9
 #define SUMP_TRIG_VALS_4  0xcd
+#define SUMP_TRIG_CFG_1	0xc2
+#define SUMP_TRIG_CFG_2	0xc6
+#define SUMP_TRIG_CFG_3	0xca
+#define SUMP_TRIG_CFG_4	0xce
+/* HydraBus extension: channels which must change to match a stage */
+#define SUMP_TRIG_EDGE_1	0xc3
+#define SUMP_TRIG_EDGE_2	0xc7
+#define SUMP_TRIG_EDGE_3	0xcb
+#define SUMP_TRIG_EDGE_4	0xcf
+
+#define SUMP_FLAG_EXT_CLOCK	(1 << 6)
+#define SUMP_FLAG_INV_CLOCK	(1 << 7)
+#define SUMP_FLAG_RLE	(1 << 8)
+/* HydraBus extension: sample on both edges of the external clock */
+#define SUMP_FLAG_BOTH_EDGES	(1 << 12)
 
 #define SUMP_STATE_IDLE		0
 #define SUMP_STATE_ARMED	1
@@ -42,9 +57,15 @@
 typedef struct {
 	uint32_t trigger_masks[4];
 	uint32_t trigger_values[4];
+	uint32_t trigger_configs[4];
+	uint32_t trigger_edges[4];
 	uint32_t read_count;
 	uint32_t delay_count;
 	uint32_t divider;
+	uint32_t flags;
 	uint8_t state;
 	uint8_t channels;
 } sump_config;
+
+uint32_t sump_capture_len(uint32_t *width);
+uint32_t sump_capture_sample(uint32_t n);
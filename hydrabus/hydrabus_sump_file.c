@@ -0,0 +1,360 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2015 Nicolas OBERLI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <stdio.h> /* sprintf */
+#include <ctype.h>
+#include "common.h"
+#include "ff.h"
+#include "microsd.h"
+#include "hydrabus_sump_file.h"
+#include "hydrabus_checksum.h"
+
+#define SUMP_FILE_BUF_SIZE	512
+
+/* Local file header fields patched once the entry has been written */
+#define ZIP_LOCAL_HEADER_CRC	14
+#define ZIP_DOS_DATE	0x0021 /* 1980-01-01 */
+#define ZIP_NB_ENTRIES	3
+
+typedef struct {
+	const char *name;
+	uint32_t offset;
+	uint32_t crc;
+	uint32_t size;
+} zip_entry;
+
+static FIL file;
+static char path[FILENAME_SIZE + 4];
+static uint8_t file_buf[SUMP_FILE_BUF_SIZE];
+static uint32_t file_len;
+static uint32_t file_pos;
+static FRESULT file_err;
+static uint32_t file_crc;
+
+static void file_flush(void)
+{
+	UINT bytes_written;
+
+	if((file_len == 0) || (file_err != FR_OK)) {
+		file_len = 0;
+		return;
+	}
+	file_err = f_write(&file, file_buf, file_len, &bytes_written);
+	if((file_err == FR_OK) && (bytes_written != file_len)) {
+		/* Card full */
+		file_err = FR_DENIED;
+	}
+	file_len = 0;
+}
+
+/* Buffered write, the zip CRC is computed on the fly */
+static void file_put(const void *data, uint32_t len)
+{
+	const uint8_t *bytes = data;
+	uint32_t i;
+
+	file_crc = checksum_crc32(file_crc, bytes, len);
+	for(i = 0; i < len; i++) {
+		file_buf[file_len++] = bytes[i];
+		if(file_len == SUMP_FILE_BUF_SIZE) {
+			file_flush();
+		}
+	}
+	file_pos += len;
+}
+
+static void file_puts(const char *str)
+{
+	file_put(str, strlen(str));
+}
+
+static void file_put16(uint16_t value)
+{
+	uint8_t bytes[2] = { value & 0xff, value >> 8 };
+
+	file_put(bytes, 2);
+}
+
+static void file_put32(uint32_t value)
+{
+	uint8_t bytes[4] = {
+		value & 0xff, (value >> 8) & 0xff,
+		(value >> 16) & 0xff, value >> 24
+	};
+
+	file_put(bytes, 4);
+}
+
+/* chprintf and newlib nano do not print 64 bits values */
+static void file_put_u64(uint64_t value)
+{
+	char str[21];
+	int i;
+
+	i = sizeof(str) - 1;
+	str[i] = 0;
+	do {
+		str[--i] = '0' + (value % 10);
+		value /= 10;
+	} while(value);
+	file_puts(&str[i]);
+}
+
+static void channel_name(char *name, uint32_t channel)
+{
+	if(channel < 16) {
+		sprintf(name, "PC%ld", channel);
+	} else {
+		sprintf(name, "PB%ld", channel - 16);
+	}
+}
+
+static uint64_t sample_time(const sump_file_capture *cap, uint32_t n)
+{
+	if(cap->rate == 0) {
+		return n;
+	}
+	return ((uint64_t)n * 1000000000) / cap->rate;
+}
+
+static void vcd_write(const sump_file_capture *cap)
+{
+	char line[48];
+	char name[8];
+	uint32_t n, ch, sample, prev, changed;
+
+	file_puts("$version HydraBus $end\n");
+	file_puts("$timescale 1 ns $end\n");
+	if(cap->rate == 0) {
+		file_puts("$comment External clock, one time unit per sample $end\n");
+	}
+	file_puts("$scope module hydrabus $end\n");
+	for(ch = 0; ch < 32; ch++) {
+		if(cap->channels & (1 << ch)) {
+			channel_name(name, ch);
+			sprintf(line, "$var wire 1 %c %s $end\n", (char)('!' + ch), name);
+			file_puts(line);
+		}
+	}
+	file_puts("$upscope $end\n$enddefinitions $end\n");
+
+	/* Only value changes are written */
+	prev = 0;
+	for(n = 0; n < cap->nb_samples; n++) {
+		sample = cap->get_sample(n);
+		changed = (n == 0) ? cap->channels : ((sample ^ prev) & cap->channels);
+		prev = sample;
+		if(!changed) {
+			continue;
+		}
+
+		file_puts("#");
+		file_put_u64(sample_time(cap, n));
+		file_puts((n == 0) ? "\n$dumpvars\n" : "\n");
+		for(ch = 0; ch < 32; ch++) {
+			if(changed & (1 << ch)) {
+				line[0] = (sample & (1 << ch)) ? '1' : '0';
+				line[1] = '!' + ch;
+				line[2] = '\n';
+				file_put(line, 3);
+			}
+		}
+		if(n == 0) {
+			file_puts("$end\n");
+		}
+		if(file_err != FR_OK) {
+			return;
+		}
+	}
+	file_puts("#");
+	file_put_u64(sample_time(cap, cap->nb_samples));
+	file_puts("\n");
+}
+
+static void zip_header_start(zip_entry *entry)
+{
+	entry->offset = file_pos;
+	file_put32(0x04034b50);
+	file_put16(10); /* version needed */
+	file_put16(0); /* flags */
+	file_put16(0); /* stored */
+	file_put16(0); /* time */
+	file_put16(ZIP_DOS_DATE);
+	/* CRC and sizes patched by zip_header_end() */
+	file_put32(0);
+	file_put32(0);
+	file_put32(0);
+	file_put16(strlen(entry->name));
+	file_put16(0); /* extra field */
+	file_puts(entry->name);
+	file_crc = 0xffffffff;
+}
+
+static void zip_header_end(zip_entry *entry)
+{
+	uint32_t end;
+
+	entry->crc = ~file_crc;
+	entry->size = file_pos - entry->offset - 30 - strlen(entry->name);
+
+	file_flush();
+	end = file_pos;
+	if(file_err == FR_OK) {
+		file_err = f_lseek(&file, entry->offset + ZIP_LOCAL_HEADER_CRC);
+	}
+	file_put32(entry->crc);
+	file_put32(entry->size);
+	file_put32(entry->size);
+	file_flush();
+	file_pos = end;
+	if(file_err == FR_OK) {
+		file_err = f_lseek(&file, end);
+	}
+}
+
+/*
+ * sigrok session file: a zip archive holding the format version, the
+ * metadata and the raw samples, oldest first, as little endian words.
+ */
+static void sr_write(const sump_file_capture *cap)
+{
+	zip_entry entries[ZIP_NB_ENTRIES] = {
+		{ .name = "version" },
+		{ .name = "metadata" },
+		{ .name = "logic-1-1" },
+	};
+	char line[48];
+	char name[8];
+	uint32_t n, i, sample, cd_offset;
+
+	zip_header_start(&entries[0]);
+	file_puts("2");
+	zip_header_end(&entries[0]);
+
+	zip_header_start(&entries[1]);
+	file_puts("[global]\nsigrok version=0.3.0\n\n");
+	file_puts("[device 1]\ncapturefile=logic-1\n");
+	sprintf(line, "total probes=%ld\n", cap->width * 8);
+	file_puts(line);
+	if(cap->rate > 0) {
+		sprintf(line, "samplerate=%ld\n", cap->rate);
+		file_puts(line);
+	}
+	for(i = 0; i < cap->width * 8; i++) {
+		channel_name(name, i);
+		sprintf(line, "probe%ld=%s\n", i + 1, name);
+		file_puts(line);
+	}
+	sprintf(line, "unitsize=%ld\n", cap->width);
+	file_puts(line);
+	zip_header_end(&entries[1]);
+
+	zip_header_start(&entries[2]);
+	for(n = 0; n < cap->nb_samples; n++) {
+		sample = cap->get_sample(n);
+		file_put(&sample, cap->width);
+		if(file_err != FR_OK) {
+			return;
+		}
+	}
+	zip_header_end(&entries[2]);
+
+	/* Central directory */
+	cd_offset = file_pos;
+	for(i = 0; i < ZIP_NB_ENTRIES; i++) {
+		file_put32(0x02014b50);
+		file_put16(10); /* version made by */
+		file_put16(10); /* version needed */
+		file_put16(0);
+		file_put16(0);
+		file_put16(0);
+		file_put16(ZIP_DOS_DATE);
+		file_put32(entries[i].crc);
+		file_put32(entries[i].size);
+		file_put32(entries[i].size);
+		file_put16(strlen(entries[i].name));
+		file_put16(0); /* extra field */
+		file_put16(0); /* comment */
+		file_put16(0); /* disk */
+		file_put16(0); /* internal attributes */
+		file_put32(0); /* external attributes */
+		file_put32(entries[i].offset);
+		file_puts(entries[i].name);
+	}
+	file_put32(0x06054b50);
+	file_put16(0);
+	file_put16(0);
+	file_put16(ZIP_NB_ENTRIES);
+	file_put16(ZIP_NB_ENTRIES);
+	file_put32(file_pos - cd_offset - 12);
+	file_put32(cd_offset);
+	file_put16(0);
+}
+
+static bool is_sigrok_file(const char *filename)
+{
+	uint32_t len;
+
+	len = strlen(filename);
+	return (len > 3) && (filename[len - 3] == '.') &&
+	       (tolower((int)filename[len - 2]) == 's') &&
+	       (tolower((int)filename[len - 1]) == 'r');
+}
+
+int sump_file_save(t_hydra_console *con, const char *filename,
+		   const sump_file_capture *cap)
+{
+	int err;
+
+	if (!is_fs_ready() && (err = mount())) {
+		cprintf(con, "Mount failed: error %d.\r\n", err);
+		return FALSE;
+	}
+
+	snprintf(path, FILENAME_SIZE, "0:%s", filename);
+	file_err = f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS);
+	if (file_err != FR_OK) {
+		cprintf(con, "Failed to open file %s: error %d.\r\n", path,
+			file_err);
+		return FALSE;
+	}
+
+	file_len = 0;
+	file_pos = 0;
+	if(is_sigrok_file(filename)) {
+		sr_write(cap);
+	} else {
+		vcd_write(cap);
+	}
+	file_flush();
+
+	err = f_close(&file);
+	if(file_err == FR_OK) {
+		file_err = err;
+	}
+	if (file_err != FR_OK) {
+		cprintf(con, "Failed to write file %s: error %d.\r\n", path,
+			file_err);
+		return FALSE;
+	}
+
+	cprintf(con, "%d samples saved to %s (%d bytes).\r\n",
+		cap->nb_samples, path, file_pos);
+	return TRUE;
+}
@@ -0,0 +1,45 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2015 Nicolas OBERLI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYDRABUS_SUMP_FILE_H_
+#define _HYDRABUS_SUMP_FILE_H_
+
+#include "common.h"
+
+/* Return the n-th sample of the capture, oldest first */
+typedef uint32_t (*sump_file_sample_cb)(uint32_t n);
+
+typedef struct {
+	uint32_t nb_samples;
+	/* Sample rate in Hz, 0 for an external clock */
+	uint32_t rate;
+	/* Channels saved in the file, one bit per channel */
+	uint32_t channels;
+	/* Bytes per sample in sigrok files */
+	uint32_t width;
+	sump_file_sample_cb get_sample;
+} sump_file_capture;
+
+/*
+ * Save a capture on the microSD card, as a sigrok session when the
+ * filename ends with .sr, as VCD otherwise.
+ */
+int sump_file_save(t_hydra_console *con, const char *filename,
+		   const sump_file_capture *cap);
+
+#endif /* _HYDRABUS_SUMP_FILE_H_ */
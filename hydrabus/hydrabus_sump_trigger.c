@@ -0,0 +1,185 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2015 Nicolas OBERLI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "hydrabus_sump_trigger.h"
+
+/*
+ * A stage without mask, edge or start bit would only bump the trigger
+ * level on every sample, this is how clients leave unused stages.
+ */
+static int stage_enabled(const sump_trigger_stage *stage)
+{
+	return stage->mask || stage->edge ||
+	       (stage->config & SUMP_TRIG_CFG_START);
+}
+
+void sump_trigger_init(sump_trigger *trig)
+{
+	const sump_trigger_stage *stage;
+	uint32_t i;
+
+	trig->level = 0;
+	trig->prev = 0;
+	trig->active = 0;
+	trig->pending = 0;
+	trig->started = 0;
+	for(i = 0; i < SUMP_TRIGGER_STAGES; i++) {
+		trig->shift[i] = 0;
+		trig->countdown[i] = 0;
+		if(stage_enabled(&trig->stages[i])) {
+			trig->active |= 1 << i;
+		}
+	}
+
+	/* A single parallel level stage starting the capture immediately */
+	stage = &trig->stages[0];
+	trig->fast = (trig->active == 0x01) && (stage->edge == 0) &&
+		     ((stage->config & ~SUMP_TRIG_CFG_CHANNEL_MASK) ==
+		      SUMP_TRIG_CFG_START);
+}
+
+static inline uint32_t get_sample(const void *samples, uint32_t index,
+				  uint32_t width, uint32_t shift)
+{
+	switch(width) {
+	case 1:
+		return ((const uint8_t *)samples)[index] << shift;
+	case 2:
+		return ((const uint16_t *)samples)[index] << shift;
+	default:
+		return ((const uint32_t *)samples)[index];
+	}
+}
+
+/* Level match on stage 0 only, this is the common case */
+static int32_t scan_fast(const sump_trigger *trig, const void *samples,
+			 uint32_t len, uint32_t width, uint32_t shift)
+{
+	const uint8_t *samples8;
+	const uint16_t *samples16;
+	const uint32_t *samples32;
+	uint32_t value, mask;
+	uint32_t i;
+
+	value = trig->stages[0].value >> shift;
+	mask = trig->stages[0].mask >> shift;
+
+	switch(width) {
+	case 1:
+		samples8 = samples;
+		mask &= 0xff;
+		for(i = 0; i < len; i++) {
+			if(!((samples8[i] ^ value) & mask)) {
+				return i;
+			}
+		}
+		break;
+	case 2:
+		samples16 = samples;
+		mask &= 0xffff;
+		for(i = 0; i < len; i++) {
+			if(!((samples16[i] ^ value) & mask)) {
+				return i;
+			}
+		}
+		break;
+	default:
+		samples32 = samples;
+		for(i = 0; i < len; i++) {
+			if(!((samples32[i] ^ value) & mask)) {
+				return i;
+			}
+		}
+		break;
+	}
+	return -1;
+}
+
+/*
+ * Feed len samples to the trigger sequencer.
+ * width is the size of a sample in bytes, shift the position of its
+ * lowest channel. The state is kept between calls so samples can be
+ * given chunk by chunk.
+ * Return the index of the sample where the trigger fires or -1.
+ */
+int32_t sump_trigger_scan(sump_trigger *trig, const void *samples,
+			  uint32_t len, uint32_t width, uint32_t shift)
+{
+	const sump_trigger_stage *stage;
+	uint32_t sample, bit, match, step;
+	uint32_t i, n;
+
+	if(trig->fast) {
+		return scan_fast(trig, samples, len, width, shift);
+	}
+
+	for(i = 0; i < len; i++) {
+		sample = get_sample(samples, i, width, shift);
+		if(!trig->started) {
+			trig->prev = sample;
+			trig->started = 1;
+		}
+		/* Level changes apply from the next sample */
+		step = 0;
+
+		for(n = 0; n < SUMP_TRIGGER_STAGES; n++) {
+			bit = 1 << n;
+			if(!(trig->active & bit)) {
+				continue;
+			}
+			stage = &trig->stages[n];
+
+			if(stage->config & SUMP_TRIG_CFG_SERIAL) {
+				trig->shift[n] <<= 1;
+				trig->shift[n] |= (sample >> SUMP_TRIG_CFG_CHANNEL(stage->config)) & 1;
+				match = !((trig->shift[n] ^ stage->value) & stage->mask);
+			} else {
+				match = !((sample ^ stage->value) & (stage->mask | stage->edge)) &&
+					(((sample ^ trig->prev) & stage->edge) == stage->edge);
+			}
+
+			if(trig->pending & bit) {
+				/* Stage matched, waiting for its delay */
+				if(--trig->countdown[n] > 0) {
+					continue;
+				}
+				trig->pending &= ~bit;
+			} else {
+				if(!match ||
+				   SUMP_TRIG_CFG_LEVEL(stage->config) != trig->level) {
+					continue;
+				}
+				if(SUMP_TRIG_CFG_DELAY(stage->config) > 0) {
+					trig->countdown[n] = SUMP_TRIG_CFG_DELAY(stage->config);
+					trig->pending |= bit;
+					continue;
+				}
+			}
+
+			/* Stage fired */
+			if(stage->config & SUMP_TRIG_CFG_START) {
+				trig->prev = sample;
+				return i;
+			}
+			step = 1;
+		}
+		trig->level += step;
+		trig->prev = sample;
+	}
+	return -1;
+}
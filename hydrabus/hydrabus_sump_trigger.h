@@ -0,0 +1,65 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2015 Nicolas OBERLI
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYDRABUS_SUMP_TRIGGER_H_
+#define _HYDRABUS_SUMP_TRIGGER_H_
+
+#include <stdint.h>
+
+/*
+ * SUMP trigger evaluator.
+ * This file only depends on stdint.h so it can be built and tested on a
+ * host with synthetic sample streams.
+ */
+
+#define SUMP_TRIGGER_STAGES	4
+
+/* Trigger configuration word (SUMP_TRIG_CFG_x) */
+#define SUMP_TRIG_CFG_DELAY(cfg)	((cfg) & 0xffff)
+#define SUMP_TRIG_CFG_LEVEL(cfg)	(((cfg) >> 16) & 0x03)
+#define SUMP_TRIG_CFG_CHANNEL(cfg)	(((cfg) >> 20) & 0x1f)
+#define SUMP_TRIG_CFG_CHANNEL_MASK	(0x1f << 20)
+#define SUMP_TRIG_CFG_SERIAL		(1 << 26)
+#define SUMP_TRIG_CFG_START		(1 << 27)
+
+typedef struct {
+	uint32_t mask;
+	uint32_t value;
+	/* Channels which must change from the previous sample (edge) */
+	uint32_t edge;
+	uint32_t config;
+} sump_trigger_stage;
+
+typedef struct {
+	sump_trigger_stage stages[SUMP_TRIGGER_STAGES];
+	/* Run time state */
+	uint32_t level;
+	uint32_t prev;
+	uint32_t shift[SUMP_TRIGGER_STAGES];
+	uint32_t countdown[SUMP_TRIGGER_STAGES];
+	uint8_t active;
+	uint8_t pending;
+	uint8_t fast;
+	uint8_t started;
+} sump_trigger;
+
+void sump_trigger_init(sump_trigger *trig);
+int32_t sump_trigger_scan(sump_trigger *trig, const void *samples,
+			  uint32_t len, uint32_t width, uint32_t shift);
+
+#endif /* _HYDRABUS_SUMP_TRIGGER_H_ */
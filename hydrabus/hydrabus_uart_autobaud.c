@@ -0,0 +1,297 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+#include "bsp_uart.h"
+#include "hydrabus_uart_autobaud.h"
+
+/* Edges buffer in g_sbuf */
+#define AUTOBAUD_NB_EDGES	(4096)
+/* Traffic analysed after the first edge (ms) */
+#define AUTOBAUD_TIMEOUT	(250)
+#define AUTOBAUD_MIN_EDGES	(4)
+/* Runs of one bit time, a lone glitch is not a bit */
+#define AUTOBAUD_MIN_MATCH	(3)
+/* Longest run inside a frame: start, 8 data and parity bits */
+#define AUTOBAUD_MAX_BITS	(10)
+/* Longer runs are idle line, capped to keep the bit count small */
+#define AUTOBAUD_IDLE_BITS	(64)
+/* Number of start bit candidates tried to align on the frames */
+#define AUTOBAUD_NB_ALIGN	(12)
+/* Snap to a standard rate within 3% */
+#define AUTOBAUD_STD_TOLERANCE	(3)
+/* Edges used to look for the bit time */
+#define AUTOBAUD_MIN_RUN_EDGES	(1024)
+
+static const char* str_bsp_init_err= { "bsp_uart_init() error %d\r\n" };
+
+static const uint32_t std_baudrates[] = {
+	300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 28800, 31250, 38400,
+	57600, 74880, 115200, 230400, 250000, 460800, 500000, 921600,
+	1000000, 1500000, 2000000, 2500000, 3000000, 4000000, 5000000,
+};
+
+typedef struct {
+	const uint32_t *edges;
+	uint32_t nb_edges;
+	/* Bit time in 1/256 tick */
+	uint64_t bit;
+	uint8_t level;
+	/* Current run (between edge run and run+1) and bits left in it */
+	uint32_t run;
+	uint32_t left;
+} bit_reader_t;
+
+/*
+ * Average of the shortest runs, from the smallest run followed by at least
+ * min_match runs up to 1.5 times its length.
+ */
+static uint32_t min_run(const uint32_t *edges, uint32_t nb_edges,
+			uint32_t min_match)
+{
+	uint32_t i, j, c, d, match, sum, best, avg;
+
+	if(nb_edges > AUTOBAUD_MIN_RUN_EDGES)
+		nb_edges = AUTOBAUD_MIN_RUN_EDGES;
+
+	best = 0;
+	avg = 0;
+	for(i = 1; i < nb_edges; i++) {
+		c = edges[i] - edges[i - 1];
+		if((c == 0) || ((best != 0) && (c >= best)))
+			continue;
+
+		match = 0;
+		sum = 0;
+		for(j = 1; j < nb_edges; j++) {
+			d = edges[j] - edges[j - 1];
+			if((d >= c) && (d <= c + (c / 2))) {
+				match++;
+				sum += d;
+			}
+		}
+		if(match >= min_match) {
+			best = c;
+			avg = (sum + (match / 2)) / match;
+		}
+	}
+	return avg;
+}
+
+static uint32_t run_bits(bit_reader_t *r, uint32_t run)
+{
+	uint64_t d;
+
+	d = (uint64_t)(r->edges[run + 1] - r->edges[run]) << 8;
+	d = (d + (r->bit / 2)) / r->bit;
+	return (d > AUTOBAUD_IDLE_BITS) ? AUTOBAUD_IDLE_BITS : d;
+}
+
+static uint8_t run_level(bit_reader_t *r, uint32_t run)
+{
+	return r->level ^ ((run + 1) & 1);
+}
+
+/* Return the next bit or -1 at the end of the capture */
+static int next_bit(bit_reader_t *r)
+{
+	while(r->left == 0) {
+		r->run++;
+		if(r->run + 1 >= r->nb_edges)
+			return -1;
+		r->left = run_bits(r, r->run);
+	}
+	r->left--;
+	return run_level(r, r->run);
+}
+
+/*
+ * Decode 8 data bits frames from the low run 'run'.
+ * Return the number of frames, errors is the number of bad parity or
+ * stop bit, min_high the fewest high bits between two frames.
+ */
+static uint32_t check_frames(bit_reader_t *r, uint32_t run, uint8_t parity,
+			     uint32_t *errors, uint32_t *min_high)
+{
+	uint32_t nb_frames, high, ones, i;
+	int bit;
+
+	r->run = run;
+	r->left = run_bits(r, run);
+	nb_frames = 0;
+	*errors = 0;
+	*min_high = AUTOBAUD_IDLE_BITS;
+
+	while(1) {
+		/* Start bit, the stop bit of the previous frame is counted */
+		high = 1;
+		while((bit = next_bit(r)) == 1)
+			high++;
+		if(bit < 0)
+			break;
+		if((nb_frames > 0) && (high < *min_high))
+			*min_high = high;
+
+		ones = 0;
+		for(i = 0; i < 8; i++) {
+			bit = next_bit(r);
+			if(bit < 0)
+				return nb_frames;
+			ones += bit;
+		}
+		if(parity != 0) {
+			bit = next_bit(r);
+			if(bit < 0)
+				return nb_frames;
+			/* 1: even, 2: odd */
+			if(((ones + bit) & 1) != (uint32_t)(parity - 1))
+				(*errors)++;
+		}
+		bit = next_bit(r);
+		if(bit < 0)
+			return nb_frames;
+		if(bit == 0)
+			(*errors)++;
+		nb_frames++;
+	}
+	return nb_frames;
+}
+
+bool uart_autobaud_analyze(const uint32_t *edges, uint32_t nb_edges,
+			   uint8_t level, uint32_t freq, uart_autobaud_t *res)
+{
+	bit_reader_t r;
+	uint64_t sum_d, sum_n, err;
+	uint32_t bit, i, d, n, parity, run, nb_align;
+	uint32_t nb_frames, errors, min_high;
+	uint32_t best_frames, best_high;
+
+	if(nb_edges < AUTOBAUD_MIN_EDGES)
+		return FALSE;
+
+	bit = min_run(edges, nb_edges, AUTOBAUD_MIN_MATCH);
+	if(bit == 0)
+		bit = min_run(edges, nb_edges, 1);
+	if(bit == 0)
+		return FALSE;
+
+	/* Average on all the runs of a few bits */
+	sum_d = 0;
+	sum_n = 0;
+	for(i = 1; i < nb_edges; i++) {
+		d = edges[i] - edges[i - 1];
+		n = (d + (bit / 2)) / bit;
+		if((n == 0) || (n > AUTOBAUD_MAX_BITS))
+			continue;
+		err = (d > n * bit) ? (d - n * bit) : (n * bit - d);
+		if(err > bit / 4)
+			continue;
+		sum_d += d;
+		sum_n += n;
+	}
+	res->baudrate = ((uint64_t)freq * sum_n + (sum_d / 2)) / sum_d;
+
+	res->std_baudrate = res->baudrate;
+	for(i = 0; i < ARRAY_SIZE(std_baudrates); i++) {
+		d = std_baudrates[i];
+		err = (res->baudrate > d) ? (res->baudrate - d) : (d - res->baudrate);
+		if(err * 100 <= (uint64_t)d * AUTOBAUD_STD_TOLERANCE) {
+			res->std_baudrate = d;
+			break;
+		}
+	}
+
+	/* Frame format, 8 data bits only, no parity preferred on a tie */
+	r.edges = edges;
+	r.nb_edges = nb_edges;
+	r.bit = (sum_d << 8) / sum_n;
+	r.level = level;
+
+	res->parity = 0;
+	res->stop_bits = 1;
+	res->nb_frames = 0;
+	for(parity = 0; parity < 3; parity++) {
+		best_frames = 0;
+		best_high = 0;
+		nb_align = 0;
+		for(run = 0; (run + 1 < nb_edges) && (nb_align < AUTOBAUD_NB_ALIGN); run++) {
+			if(run_level(&r, run) != 0)
+				continue;
+			nb_align++;
+			nb_frames = check_frames(&r, run, parity, &errors, &min_high);
+			if((errors == 0) && (nb_frames > best_frames)) {
+				best_frames = nb_frames;
+				best_high = min_high;
+			}
+		}
+		if(best_frames > 0) {
+			res->parity = parity;
+			/* Back to back frames show the number of stop bits */
+			res->stop_bits = (best_high == 2) ? 2 : 1;
+			res->nb_frames = best_frames;
+			break;
+		}
+	}
+	return TRUE;
+}
+
+void uart_autobaud(t_hydra_console *con)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	uint32_t *edges = (uint32_t *)g_sbuf;
+	uart_autobaud_t res;
+	uint32_t nb_edges;
+	uint8_t level;
+	bsp_status_t status;
+
+	cprintf(con, "Waiting for data on RX.\r\n");
+	cprintf(con, "Interrupt by pressing user button.\r\n");
+
+	nb_edges = bsp_uart_capture_edges(proto->dev_num, edges,
+					  AUTOBAUD_NB_EDGES, AUTOBAUD_TIMEOUT,
+					  &level);
+
+	if(nb_edges == 0) {
+		cprintf(con, "Aborted.\r\n");
+	} else if(!uart_autobaud_analyze(edges, nb_edges, level,
+					 BSP_UART_CAPTURE_FREQ, &res)) {
+		cprintf(con, "Not enough edges (%d) to measure the speed.\r\n",
+			nb_edges);
+	} else {
+		cprintf(con, "Measured speed: %d bps\r\n", res.baudrate);
+		proto->dev_speed = res.std_baudrate;
+		if(res.nb_frames > 0) {
+			proto->dev_parity = res.parity;
+			proto->dev_stop_bit = res.stop_bits;
+			cprintf(con, "Frame format: 8%c%d (%d frames checked)\r\n",
+				"NEO"[res.parity], res.stop_bits, res.nb_frames);
+		} else {
+			cprintf(con, "Frame format not recognized, kept 8%c%d\r\n",
+				"NEO"[proto->dev_parity], proto->dev_stop_bit);
+		}
+	}
+
+	/* Give the RX pin back to the UART */
+	status = bsp_uart_init(proto->dev_num, proto);
+	if(status != BSP_OK) {
+		cprintf(con, str_bsp_init_err, status);
+		return;
+	}
+	cprintf(con, "Final speed: %d bps\r\n",
+		bsp_uart_get_final_baudrate(proto->dev_num));
+}
@@ -0,0 +1,49 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYDRABUS_UART_AUTOBAUD_H_
+#define _HYDRABUS_UART_AUTOBAUD_H_
+
+#include "common.h"
+
+typedef struct {
+	/* Measured and nearest standard baud rate */
+	uint32_t baudrate;
+	uint32_t std_baudrate;
+	/* Frame format, same values as mode_config_proto_t */
+	uint8_t parity;
+	uint8_t stop_bits;
+	/* Frames checked against the format, 0 if not recognized */
+	uint32_t nb_frames;
+} uart_autobaud_t;
+
+/*
+ * Measure the baud rate and frame format of nb_edges edges timestamped at
+ * freq Hz, level is the line level before the first edge.
+ * Return FALSE when there are not enough edges.
+ */
+bool uart_autobaud_analyze(const uint32_t *edges, uint32_t nb_edges,
+			   uint8_t level, uint32_t freq, uart_autobaud_t *res);
+
+/*
+ * "autobaud" command of the UART mode, capture the RX pin and configure
+ * the UART with the result.
+ */
+void uart_autobaud(t_hydra_console *con);
+
+#endif /* _HYDRABUS_UART_AUTOBAUD_H_ */
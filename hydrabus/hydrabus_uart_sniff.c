@@ -0,0 +1,289 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "common.h"
+#include "tokenline.h"
+#include "ff.h"
+#include "microsd.h"
+#include "bsp_uart.h"
+#include "hydrabus_uart_sniff.h"
+#include <stdio.h> /* snprintf */
+#include <string.h>
+
+/* Buffers in g_sbuf: one RX ring per line, chunk copy, file buffer */
+#define SNIFF_RX_RING_SIZE	(24576)
+#define SNIFF_CHUNK_SIZE	(32)
+#define SNIFF_FILE_BUF_SIZE	(4096)
+#define SNIFF_FILE_BUF_OFFSET	(2 * SNIFF_RX_RING_SIZE + SNIFF_CHUNK_SIZE)
+/* Timestamp, direction and hex dump of one chunk */
+#define SNIFF_LINE_SIZE		(32 + 3 * SNIFF_CHUNK_SIZE)
+
+/* One direction of the link */
+typedef struct {
+	bsp_dev_uart_t dev;
+	/* Bytes read or lost */
+	uint32_t pos;
+	uint32_t lost;
+	uint32_t nb_bytes;
+	/* Next mark, bytes up to mark_count were received at mark_cycles */
+	bool marked;
+	uint32_t mark_count;
+	uint32_t mark_cycles;
+} sniff_line_t;
+
+static const char* str_bsp_init_err= { "bsp_uart_init() error %d\r\n" };
+
+static FIL file;
+static char path[FILENAME_SIZE + 4];
+static uint8_t *file_buf;
+static uint32_t file_len;
+static FRESULT file_err;
+
+static void file_flush(void)
+{
+	UINT bytes_written;
+
+	if((file_len == 0) || (file_err != FR_OK)) {
+		file_len = 0;
+		return;
+	}
+	file_err = f_write(&file, file_buf, file_len, &bytes_written);
+	if((file_err == FR_OK) && (bytes_written != file_len)) {
+		/* Card full */
+		file_err = FR_DENIED;
+	}
+	file_len = 0;
+}
+
+static void file_put(const char *data, uint32_t len)
+{
+	uint32_t n;
+
+	while(len > 0) {
+		n = SNIFF_FILE_BUF_SIZE - file_len;
+		if(n > len)
+			n = len;
+		memcpy(&file_buf[file_len], data, n);
+		file_len += n;
+		data += n;
+		len -= n;
+		if(file_len == SNIFF_FILE_BUF_SIZE)
+			file_flush();
+	}
+}
+
+static bool sniff_open(t_hydra_console *con, const char *filename)
+{
+	int err;
+
+	if (!is_fs_ready() && (err = mount())) {
+		cprintf(con, "Mount failed: error %d.\r\n", err);
+		return FALSE;
+	}
+
+	snprintf(path, FILENAME_SIZE, "0:%s", filename);
+	err = f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS);
+	if (err != FR_OK) {
+		cprintf(con, "Failed to open file %s: error %d.\r\n", path, err);
+		return FALSE;
+	}
+	file_buf = (uint8_t *)g_sbuf + SNIFF_FILE_BUF_OFFSET;
+	file_len = 0;
+	file_err = FR_OK;
+
+	return TRUE;
+}
+
+/* "<seconds>.<microseconds> <uart>: <hex bytes>" */
+static uint32_t format_chunk(char *line, uint64_t us, int uart,
+			     const uint8_t *data, uint32_t len)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint32_t i, n;
+
+	n = snprintf(line, SNIFF_LINE_SIZE, "%lu.%06lu %d:",
+		     (uint32_t)(us / 1000000), (uint32_t)(us % 1000000), uart);
+	for(i = 0; i < len; i++) {
+		line[n++] = ' ';
+		line[n++] = hex[data[i] >> 4];
+		line[n++] = hex[data[i] & 0x0f];
+	}
+	line[n++] = '\r';
+	line[n++] = '\n';
+
+	return n;
+}
+
+/* Bytes received up to the mark, stamped with the time of the mark */
+static void sniff_read(t_hydra_console *con, sniff_line_t *l, bool to_file,
+		       uint64_t us)
+{
+	uint8_t *chunk = (uint8_t *)g_sbuf + 2 * SNIFF_RX_RING_SIZE;
+	char line[SNIFF_LINE_SIZE];
+	uint32_t len, line_len, lost;
+
+	while((int32_t)(l->mark_count - l->pos) > 0) {
+		len = l->mark_count - l->pos;
+		if(len > SNIFF_CHUNK_SIZE)
+			len = SNIFF_CHUNK_SIZE;
+		len = bsp_uart_rx_dma_read(l->dev, chunk, len, TIME_IMMEDIATE);
+		lost = bsp_uart_rx_dma_lost(l->dev);
+		l->pos += len + (lost - l->lost);
+		l->lost = lost;
+		if(len == 0)
+			break;
+
+		line_len = format_chunk(line, us, l->dev + 1, chunk, len);
+		if(to_file)
+			file_put(line, line_len);
+		else
+			cprint(con, line, line_len);
+		l->nb_bytes += len;
+	}
+}
+
+/*
+ * The marks are recorded by the RX interrupts, so output or microSD
+ * stalls do not change the timestamps.
+ */
+static void sniff(t_hydra_console *con, sniff_line_t *lines, bool to_file,
+		  uint32_t start)
+{
+	sniff_line_t *l;
+	uint64_t cycles;
+	uint32_t last, now;
+	int i;
+
+	cycles = 0;
+	last = start;
+	while(!USER_BUTTON) {
+		l = NULL;
+		for(i = 0; i < 2; i++) {
+			if(!lines[i].marked) {
+				lines[i].marked = bsp_uart_rx_dma_mark(lines[i].dev,
+								       &lines[i].mark_count,
+								       &lines[i].mark_cycles);
+			}
+			/* Oldest mark first, both directions stay in time order */
+			if(lines[i].marked && ((l == NULL) ||
+			   ((int32_t)(lines[i].mark_cycles - l->mark_cycles) < 0)))
+				l = &lines[i];
+		}
+		if(l == NULL) {
+			/* Follow CYCCNT while idle, it wraps every 25.6s */
+			now = get_cyclecounter();
+			cycles += now - last;
+			last = now;
+			chThdSleep(1);
+			continue;
+		}
+
+		/* A mark may be recorded just before the idle update */
+		cycles += (int64_t)(int32_t)(l->mark_cycles - last);
+		last = l->mark_cycles;
+		l->marked = FALSE;
+		sniff_read(con, l, to_file, cycles / (STM32_SYSCLK / 1000000));
+	}
+}
+
+int uart_sniff_exec(t_hydra_console *con, t_tokenline_parsed *p,
+		    int token_pos)
+{
+	mode_config_proto_t* proto = &con->mode->proto;
+	mode_config_proto_t other;
+	sniff_line_t lines[2];
+	const char *filename;
+	uint32_t start;
+	int str_offset, t, i;
+	bsp_status_t status;
+	bool done;
+
+	filename = NULL;
+	done = FALSE;
+	for (t = token_pos; !done && p->tokens[t]; t++) {
+		switch (p->tokens[t]) {
+		case T_FILE:
+			t += 2;
+			memcpy(&str_offset, &p->tokens[t], sizeof(int));
+			filename = p->buf + str_offset;
+			break;
+		default:
+			done = TRUE;
+			t--;
+			break;
+		}
+	}
+
+	/* Same line settings on the UART which is not the mode one */
+	other = *proto;
+	other.dev_num = (proto->dev_num == BSP_DEV_UART1) ? BSP_DEV_UART2 : BSP_DEV_UART1;
+	status = bsp_uart_init(other.dev_num, &other);
+	if(status != BSP_OK) {
+		cprintf(con, str_bsp_init_err, status);
+		bsp_uart_deinit(other.dev_num);
+		return t - token_pos;
+	}
+
+	memset(lines, 0, sizeof(lines));
+	lines[0].dev = BSP_DEV_UART1;
+	lines[1].dev = BSP_DEV_UART2;
+	start = get_cyclecounter();
+	for(i = 0; i < 2; i++) {
+		status = bsp_uart_rx_dma_start(lines[i].dev,
+					       (uint8_t *)g_sbuf + i * SNIFF_RX_RING_SIZE,
+					       SNIFF_RX_RING_SIZE);
+		if(status != BSP_OK) {
+			cprintf(con, "UART%d RX DMA not available.\r\n", lines[i].dev + 1);
+			break;
+		}
+	}
+
+	if((status == BSP_OK) && ((filename == NULL) || sniff_open(con, filename))) {
+		cprintf(con, "Sniffing UART1 RX (PA10) and UART2 RX (PA3) at %d bps.\r\n",
+			bsp_uart_get_final_baudrate(proto->dev_num));
+		cprintf(con, "Leave TX pins unconnected.\r\n");
+		cprintf(con, "Each chunk is stamped with the end of its burst.\r\n");
+		cprintf(con, "Interrupt by pressing user button.\r\n");
+		cprint(con, "\r\n", 2);
+
+		sniff(con, lines, filename != NULL, start);
+
+		if(filename != NULL) {
+			file_flush();
+			if(file_err == FR_OK)
+				file_err = f_close(&file);
+			else
+				f_close(&file);
+			if(file_err != FR_OK)
+				cprintf(con, "Failed to write file: error %d.\r\n", file_err);
+			else
+				cprintf(con, "Saved to %s.\r\n", path);
+		}
+		for(i = 0; i < 2; i++) {
+			cprintf(con, "UART%d: %d bytes, %d lost.\r\n",
+				lines[i].dev + 1, lines[i].nb_bytes,
+				bsp_uart_rx_dma_lost(lines[i].dev));
+		}
+	}
+
+	for(i = 0; i < 2; i++)
+		bsp_uart_rx_dma_stop(lines[i].dev);
+	bsp_uart_deinit(other.dev_num);
+
+	return t - token_pos;
+}
@@ -0,0 +1,32 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HYDRABUS_UART_SNIFF_H_
+#define _HYDRABUS_UART_SNIFF_H_
+
+#include "common.h"
+
+/*
+ * "sniff" command of the UART mode, UART1 and UART2 receive both lines of
+ * a link until the user button is pressed. token_pos is the first token
+ * after "sniff", return the number of tokens used.
+ */
+int uart_sniff_exec(t_hydra_console *con, t_tokenline_parsed *p,
+		    int token_pos);
+
+#endif /* _HYDRABUS_UART_SNIFF_H_ */
@@ -0,0 +1,279 @@
+/*
+ * HydraBus/HydraNFC
+ *
+ * Copyright (C) 2014-2016 Benjamin VERNOUX
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Host test of the SUMP trigger evaluator with synthetic sample streams */
+
+#include <stdio.h>
+#include <string.h>
+#include "hydrabus_sump_trigger.h"
+
+#define ARRAY_SIZE(x) (sizeof((x))/sizeof((x)[0]))
+
+#define CFG_DELAY(d)	((d) & 0xffff)
+#define CFG_LEVEL(l)	(((l) & 0x03) << 16)
+#define CFG_CHANNEL(c)	(((c) & 0x1f) << 20)
+
+static int failures;
+
+static void check(const char *name, int32_t got, int32_t expected)
+{
+	if(got != expected) {
+		printf("FAIL %s: got %d, expected %d\n", name, got, expected);
+		failures++;
+	} else {
+		printf("ok   %s\n", name);
+	}
+}
+
+static void setup(sump_trigger *trig)
+{
+	memset(trig, 0, sizeof(*trig));
+}
+
+static void test_level(void)
+{
+	const uint8_t samples[] = { 0x00, 0x01, 0x14, 0x35, 0x05 };
+	sump_trigger trig;
+
+	setup(&trig);
+	trig.stages[0].mask = 0x0f;
+	trig.stages[0].value = 0x05;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("level uses the fast path", trig.fast, 1);
+	check("level", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 3);
+}
+
+static void test_level_shift(void)
+{
+	const uint16_t samples[] = { 0x0000, 0x0100, 0x8001, 0x0001 };
+	sump_trigger trig;
+
+	/* Second group of 16 channels, GPIOB in 32 channels mode */
+	setup(&trig);
+	trig.stages[0].mask = 0x80010000;
+	trig.stages[0].value = 0x00010000;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("level on shifted 16 bits samples",
+	      sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 2, 16), 3);
+}
+
+static void test_edge(void)
+{
+	const uint8_t samples[] = { 0x01, 0x01, 0x00, 0x00, 0x01, 0x00 };
+	sump_trigger trig;
+
+	/* The first sample is not an edge even if it matches the level */
+	setup(&trig);
+	trig.stages[0].edge = 0x01;
+	trig.stages[0].value = 0x01;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("edge is not the fast path", trig.fast, 0);
+	check("rising edge", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 4);
+
+	setup(&trig);
+	trig.stages[0].edge = 0x01;
+	trig.stages[0].value = 0x00;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("falling edge", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 2);
+}
+
+static void test_edge_and_level(void)
+{
+	const uint8_t samples[] = { 0x00, 0x01, 0x00, 0x03 };
+	sump_trigger trig;
+
+	/* Rising edge on channel 0 while channel 1 is high */
+	setup(&trig);
+	trig.stages[0].edge = 0x01;
+	trig.stages[0].mask = 0x02;
+	trig.stages[0].value = 0x03;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("edge and level", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 3);
+}
+
+static void test_multi_stage(void)
+{
+	const uint8_t samples[] = { 0x02, 0x01, 0x00, 0x04, 0x02, 0x02 };
+	sump_trigger trig;
+
+	/* 0x01, then 0x02: the 0x02 seen before the first stage is ignored */
+	setup(&trig);
+	trig.stages[0].mask = 0xff;
+	trig.stages[0].value = 0x01;
+	trig.stages[0].config = CFG_LEVEL(0);
+	trig.stages[1].mask = 0xff;
+	trig.stages[1].value = 0x02;
+	trig.stages[1].config = CFG_LEVEL(1) | SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("two stages", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 4);
+}
+
+static void test_multi_stage_same_sample(void)
+{
+	const uint8_t samples[] = { 0x00, 0x03, 0x03, 0x00 };
+	sump_trigger trig;
+
+	/* A level reached on a sample only applies from the next one */
+	setup(&trig);
+	trig.stages[0].mask = 0x01;
+	trig.stages[0].value = 0x01;
+	trig.stages[0].config = CFG_LEVEL(0);
+	trig.stages[1].mask = 0x02;
+	trig.stages[1].value = 0x02;
+	trig.stages[1].config = CFG_LEVEL(1) | SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("next level from the next sample",
+	      sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 2);
+}
+
+static void test_four_stages_chunked(void)
+{
+	const uint8_t samples[] = {
+		0x00, 0x01, 0x00, 0x02, 0x01, 0x04, 0x03, 0x08, 0x00
+	};
+	sump_trigger trig;
+	int32_t ret;
+	uint32_t i, n;
+
+	setup(&trig);
+	for(n = 0; n < SUMP_TRIGGER_STAGES; n++) {
+		trig.stages[n].mask = 0x0f;
+		trig.stages[n].value = 1 << n;
+		trig.stages[n].config = CFG_LEVEL(n);
+	}
+	trig.stages[3].config |= SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+
+	/* One sample per call, the state is kept between chunks */
+	ret = -1;
+	for(i = 0; i < ARRAY_SIZE(samples); i++) {
+		if(sump_trigger_scan(&trig, &samples[i], 1, 1, 0) == 0) {
+			ret = i;
+			break;
+		}
+	}
+	check("four stages fed sample by sample", ret, 7);
+}
+
+static void test_serial(void)
+{
+	uint8_t samples[20];
+	sump_trigger trig;
+	uint32_t i;
+	uint8_t pattern = 0xa5;
+
+	/* 0xa5 MSB first on channel 2, other channels toggling */
+	memset(samples, 0, sizeof(samples));
+	for(i = 0; i < 4; i++) {
+		samples[i] = (i & 1) ? 0x04 : 0x01;
+	}
+	for(i = 0; i < 8; i++) {
+		samples[4 + i] = ((pattern >> (7 - i)) & 1) << 2;
+		samples[4 + i] |= (i & 1) ? 0x80 : 0x00;
+	}
+
+	setup(&trig);
+	trig.stages[0].mask = 0xff;
+	trig.stages[0].value = pattern;
+	trig.stages[0].config = SUMP_TRIG_CFG_SERIAL | CFG_CHANNEL(2) |
+				SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("serial", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 11);
+
+	/* Only the masked bits are compared, 0101 is already in the noise */
+	setup(&trig);
+	trig.stages[0].mask = 0x0f;
+	trig.stages[0].value = 0x05;
+	trig.stages[0].config = SUMP_TRIG_CFG_SERIAL | CFG_CHANNEL(2) |
+				SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("serial with mask", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 3);
+}
+
+static void test_delay(void)
+{
+	const uint8_t samples[] = { 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	sump_trigger trig;
+
+	/* The stage fires delay samples after its match */
+	setup(&trig);
+	trig.stages[0].mask = 0x01;
+	trig.stages[0].value = 0x01;
+	trig.stages[0].config = CFG_DELAY(3) | SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("delay is not the fast path", trig.fast, 0);
+	check("delay", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 5);
+}
+
+static void test_delay_stage(void)
+{
+	const uint8_t samples[] = { 0x01, 0x00, 0x02, 0x00, 0x02, 0x00, 0x02 };
+	sump_trigger trig;
+
+	/* The next level starts once the delay of the first stage is over */
+	setup(&trig);
+	trig.stages[0].mask = 0xff;
+	trig.stages[0].value = 0x01;
+	trig.stages[0].config = CFG_LEVEL(0) | CFG_DELAY(3);
+	trig.stages[1].mask = 0xff;
+	trig.stages[1].value = 0x02;
+	trig.stages[1].config = CFG_LEVEL(1) | SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("delayed first stage", sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 1, 0), 4);
+}
+
+static void test_no_trigger(void)
+{
+	const uint32_t samples[] = { 0x00000000, 0x10000000, 0x0fffffff };
+	sump_trigger trig;
+
+	setup(&trig);
+	trig.stages[0].mask = 0xf0000000;
+	trig.stages[0].value = 0x20000000;
+	trig.stages[0].config = SUMP_TRIG_CFG_START;
+	sump_trigger_init(&trig);
+	check("no match on 32 bits samples",
+	      sump_trigger_scan(&trig, samples, ARRAY_SIZE(samples), 4, 0), -1);
+}
+
+int main(void)
+{
+	test_level();
+	test_level_shift();
+	test_edge();
+	test_edge_and_level();
+	test_multi_stage();
+	test_multi_stage_same_sample();
+	test_four_stages_chunked();
+	test_serial();
+	test_delay();
+	test_delay_stage();
+	test_no_trigger();
+
+	if(failures > 0) {
+		printf("%d test(s) failed\n", failures);
+		return 1;
+	}
+	printf("All tests passed\n");
+	return 0;
+}
@@ -205,15 +205,20 @@ void SpiReadCont(u08_t *pbuf, u08_t length)
 
 void SpiReadSingle(u08_t *pbuf, u08_t number)
 {
+	u08_t tx[2];
+	u08_t rx[2];
+
 	bsp_spi_select(BSP_DEV_SPI2); /* Slave Select assertion. */
 
 	while(number > 0) {
 		// Address/Command Word Bit Distribution
-		*pbuf = (0x40 | *pbuf);             // address, read, single
-		*pbuf = (0x5f & *pbuf);             // register address
+		tx[0] = (0x40 | *pbuf);             // address, read, single
+		tx[0] = (0x5f & tx[0]);             // register address
+		tx[1] = 0xff;
 
-		bsp_spi_write_u8(BSP_DEV_SPI2, pbuf, 1);
-		bsp_spi_read_u8(BSP_DEV_SPI2, pbuf, 1);
+		/* Address and data in one transfer */
+		bsp_spi_write_read_u8(BSP_DEV_SPI2, tx, rx, 2);
+		*pbuf = rx[1];
 
 		pbuf++;
 		number--;
@@ -291,20 +296,16 @@ void SpiWriteCont(u08_t *pbuf, u08_t length)
 
 void SpiWriteSingle(u08_t *pbuf, u08_t length)
 {
-	u08_t	i = 0;
-
 	bsp_spi_select(BSP_DEV_SPI2); /* Slave Select assertion. */
 
 	while(length > 0) {
 		// Address/Command Word Bit Distribution
 		// address, write, single (fist 3 bits = 0)
 		*pbuf = (0x1f &*pbuf);              // register address
-		for(i = 0; i < 2; i++) {
-			bsp_spi_write_u8(BSP_DEV_SPI2, pbuf, 1);
-
-			pbuf++;
-			length--;
-		}
+		/* Address and data in one transfer */
+		bsp_spi_write_u8(BSP_DEV_SPI2, pbuf, 2);
+		pbuf += 2;
+		length = (length > 2) ? (length - 2) : 0;
 	}
 
 	bsp_spi_unselect(BSP_DEV_SPI2);